@@ -52,21 +52,67 @@
   */
 #define UTIL_WEIGHT .60
 
+/*
+ * The regression gate (-b). A trace regresses when it runs slower, or
+ * uses space less well, than in the baseline run by more than
+ * REGRESS_PCT percent (-r overrides it). When both runs timed their
+ * traces with -s, a slowdown must also pass Welch's t test on the means.
+ */
+#define REGRESS_PCT    5.0
+
+/*
+ * The payload touching replay (-w, -W). The line patterns touch one
+ * word every TOUCH_STRIDE bytes. The rand pattern steps through the
+ * lines of a block TOUCH_PRIME lines at a time, wrapping around.
+ */
+#define TOUCH_STRIDE 64
+#define TOUCH_PRIME  65537
+
+/* Requests between the rows of the heap timeline (-F, -k overrides it) */
+#define TIMELINE_OPS 100
+
+/*
+ * Requests in each of the two buffers a streamed trace (-S) is read
+ * into while the other one is replayed
+ */
+#define STREAM_CHUNK 65536
+
 /* 
  * Alignment requirement in bytes (either 4 or 8) 
  */
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. Big generated traces (see gentrace.c)
+ * need more, e.g. make CFLAGS="-Wall -O2 -m32 -DMAX_HEAP=0xc0000000"
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
+#define USE_TSC    1   /* invariant TSC, rdtscp (x86, else gettimeofday) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+
+/*
+ * With USE_TSC a trace is replayed at least TSC_RUNS times, and until
+ * the replays have taken TSC_MIN_SECS, and the median replay counts
+ */
+#define TSC_RUNS     10
+#define TSC_MIN_SECS 0.05
+
+/*
+ * The sampling mode (-s): FSECS_COLD runs on a cleared cache of
+ * FSECS_CACHE_BYTES, then FSECS_WARMUP untimed runs (-u overrides
+ * it), then the timed samples, FSECS_SAMPLES of them unless -s says.
+ */
+#define FSECS_COLD        3
+#define FSECS_WARMUP      2
+#define FSECS_SAMPLES     30
+#define FSECS_CACHE_BYTES (32*(1<<20))
 
 #endif /* __CONFIG_H */
@@ -0,0 +1,402 @@
+/*
+ * copybench.c - Measure how mm_realloc moves large blocks.
+ *
+ * Replays realloc traces against three builds of mm.c: mm_nocopy,
+ * which moves payloads with memmove, mm, which moves payloads of
+ * NT_COPY_MIN bytes or more with streaming stores (see mm-policy.h), and
+ * mm_lowcopy, which streams from LOW_COPY_MIN bytes (see the Makefile),
+ * so that the smaller moves of the realloc traces stream too. A build
+ * that would stream the same moves as one already listed runs the same
+ * code and is left out. For each build it reports the bytes the trace
+ * made the allocator move, the rate it moved them at, and how long it
+ * takes to read a hot working set right after a move, with the last
+ * level cache misses of that read where the hardware counters are
+ * available. Both go up when the move pushed the working set out of
+ * the cache.
+ *
+ * usage: copybench [-m] [-k <hot KB>] [-n <runs>] [tracefile...]
+ *
+ * Without tracefiles it uses the realloc traces in TRACEDIR, and then
+ * a sweep of traces that each move blocks of one size, from SWEEP_MIN
+ * to SWEEP_MAX bytes, on either side of NT_COPY_MIN. The moves in the
+ * realloc traces are all smaller than that. -m adds the sweep to the
+ * tracefiles given.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mm-policy.h"
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+#include "perfctr.h"
+
+MM_DECLARE_POLICY(mm_nocopy);
+MM_DECLARE_POLICY(mm_lowcopy);
+
+#define MAXLINE 1024
+#define LINE    64      /* the probe reads one word per cache line */
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+#define MAX(x, y) ((x) > (y)? (x) : (y))
+
+#define SWEEP_MIN   (64 << 10)  /* smallest move of the sweep */
+#define SWEEP_MAX   (4 << 20)   /* largest, which must fit in MAX_HEAP 3 times */
+#define SWEEP_BYTES (64 << 20)  /* bytes each step of the sweep moves */
+
+/* One request of a trace */
+typedef struct {
+    char type;          /* 'a', 'r' or 'f' */
+    int index;          /* block id */
+    int size;           /* a and r only */
+} op_t;
+
+typedef struct {
+    int num_ids;
+    int num_ops;
+    op_t *ops;
+} trace_t;
+
+/* A build of mm.c under test */
+typedef struct {
+    char *name;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    int nt_min;         /* smallest move it streams, 0 if none */
+} copy_impl_t;
+
+static copy_impl_t impls[] = {
+    {"memmove", mm_nocopy_init, mm_nocopy_malloc, mm_nocopy_free,
+     mm_nocopy_realloc, 0},
+    {"stream", mm_init, mm_malloc, mm_free, mm_realloc, NT_COPY_MIN},
+    {"lowstream", mm_lowcopy_init, mm_lowcopy_malloc, mm_lowcopy_free,
+     mm_lowcopy_realloc, LOW_COPY_MIN},
+};
+#define NUM_IMPLS (sizeof(impls) / sizeof(copy_impl_t))
+
+/* The results of one replay */
+typedef struct {
+    double moved;       /* bytes moved by realloc */
+    double secs;        /* time for the replay */
+    double probe_ns;    /* average time to read the hot set after a move */
+    double probe_llc;   /* average LLC misses of that read, -1 if unknown */
+} result_t;
+
+static int *hot;        /* the hot working set */
+static size_t hot_words;
+static volatile int sink;
+static int counters;    /* are the hardware counters there? */
+
+static trace_t *read_trace(char *filename);
+static trace_t *sweep_trace(int size);
+static int streamed(trace_t *trace, int nt_min);
+static void bench(char *name, trace_t *trace, int runs);
+static void replay(copy_impl_t *impl, trace_t *trace, int probe,
+		   result_t *res);
+static double now(void);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    char *default_files[] = {TRACEDIR "realloc-bal.rep",
+			     TRACEDIR "realloc2-bal.rep"};
+    char **files = default_files;
+    int num_files = 2;
+    size_t hot_kb = 256;
+    int runs = 5, sweep = 0;
+    char name[MAXLINE];
+    int c, f, size;
+
+    while ((c = getopt(argc, argv, "mk:n:h")) != EOF) {
+	switch (c) {
+	case 'k':
+	    hot_kb = atoi(optarg);
+	    break;
+	case 'n':
+	    runs = atoi(optarg);
+	    break;
+	case 'm':
+	    sweep = 1;
+	    break;
+	case 'h':
+	default:
+	    usage();
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (optind < argc) {
+	files = argv + optind;
+	num_files = argc - optind;
+    }
+    if (hot_kb == 0 || runs <= 0) {
+	usage();
+	exit(1);
+    }
+
+    hot_words = hot_kb * 1024 / sizeof(int);
+    if ((hot = calloc(hot_words, sizeof(int))) == NULL) {
+	fprintf(stderr, "copybench: calloc failed\n");
+	exit(1);
+    }
+    mem_init();
+    if ((counters = perfctr_init() > 0) == 0)
+	printf("No hardware counters, %s. Probe LLC misses not counted.\n",
+	       perfctr_error());
+
+    printf("Moves of %d bytes and up use streaming stores, %d with "
+	   "lowstream,\nhot set %lu KB\n\n", NT_COPY_MIN, LOW_COPY_MIN,
+	   (unsigned long)hot_kb);
+    printf("%-20s %-10s %10s %10s %10s %10s\n",
+	   "trace", "copy", "moved MB", "MB/s", "probe ns", "probe LLC");
+    for (f = 0; f < num_files; f++) {
+	char *base = strrchr(files[f], '/');
+
+	bench(base ? base + 1 : files[f], read_trace(files[f]), runs);
+    }
+    if (sweep || files == default_files)
+	for (size = SWEEP_MIN; size <= SWEEP_MAX; size *= 2) {
+	    sprintf(name, "move %dK", size >> 10);
+	    bench(name, sweep_trace(size), runs);
+	}
+    mem_deinit();
+    free(hot);
+    exit(0);
+}
+
+/*
+ * bench - Replay trace against every build that streams a different
+ *     set of its moves, print a row for each, and free the trace
+ */
+static void bench(char *name, trace_t *trace, int runs)
+{
+    int n[NUM_IMPLS];   /* moves each build streams */
+    int i, j, r, rows = 0;
+    char llc[32];
+
+    for (i = 0; i < NUM_IMPLS; i++) {
+	result_t best = {0, 0, 0, 0}, res;
+
+	/* Same moves streamed, same code run: nothing to compare */
+	n[i] = streamed(trace, impls[i].nt_min);
+	for (j = 0; j < i && n[j] != n[i]; j++)
+	    ;
+	if (j < i)
+	    continue;
+
+	/* Time without the probe, keep the fastest run */
+	for (r = 0; r < runs; r++) {
+	    replay(&impls[i], trace, 0, &res);
+	    if (best.secs == 0 || res.secs < best.secs)
+		best = res;
+	}
+	/* Then probe the hot set after every move */
+	replay(&impls[i], trace, 1, &res);
+	if (res.probe_llc >= 0)
+	    sprintf(llc, "%.0f", res.probe_llc);
+	else
+	    strcpy(llc, "-");
+	printf("%-20s %-10s %10.1f %10.0f %10.0f %10s\n",
+	       rows++ == 0 ? name : "", impls[i].name, best.moved / 1e6,
+	       best.secs > 0 ? best.moved / 1e6 / best.secs : 0,
+	       res.probe_ns, llc);
+    }
+    free(trace->ops);
+    free(trace);
+}
+
+/*
+ * replay - Run trace against impl on an empty heap. With probe set,
+ *     read the hot set after every realloc that moved its block and
+ *     time only that.
+ */
+static void replay(copy_impl_t *impl, trace_t *trace, int probe,
+		   result_t *res)
+{
+    char **blocks = calloc(trace->num_ids, sizeof(char *));
+    int *sizes = calloc(trace->num_ids, sizeof(int));
+    double start, probe_secs = 0, probe_llc = 0;
+    int i, moves = 0, llc_valid = counters;
+    pcounts_t pc;
+    size_t j;
+
+    if (blocks == NULL || sizes == NULL) {
+	fprintf(stderr, "copybench: calloc failed\n");
+	exit(1);
+    }
+    res->moved = 0;
+
+    /* Warm the hot set */
+    for (j = 0; j < hot_words; j += LINE / sizeof(int))
+	sink += hot[j];
+
+    mem_reset_brk();
+    if (impl->init() < 0) {
+	fprintf(stderr, "copybench: %s init failed\n", impl->name);
+	exit(1);
+    }
+    start = now();
+    for (i = 0; i < trace->num_ops; i++) {
+	op_t *op = &trace->ops[i];
+	char *p;
+
+	switch (op->type) {
+	case 'a':
+	    blocks[op->index] = impl->malloc(op->size);
+	    sizes[op->index] = op->size;
+	    break;
+	case 'r':
+	    p = impl->realloc(blocks[op->index], op->size);
+	    if (p != blocks[op->index]) {
+		res->moved += MIN(sizes[op->index], op->size);
+		moves++;
+		if (probe) {
+		    double t;
+		    int sum = 0;
+
+		    if (counters)
+			perfctr_start();
+		    t = now();
+		    for (j = 0; j < hot_words; j += LINE / sizeof(int))
+			sum += hot[j];
+		    probe_secs += now() - t;
+		    sink += sum;
+		    if (counters) {
+			perfctr_stop(&pc);
+			probe_llc += pc.val[PC_LLC_MISSES];
+			llc_valid &= pc.valid[PC_LLC_MISSES];
+		    }
+		}
+	    }
+	    blocks[op->index] = p;
+	    sizes[op->index] = op->size;
+	    break;
+	case 'f':
+	    impl->free(blocks[op->index]);
+	    blocks[op->index] = NULL;
+	    break;
+	}
+    }
+    res->secs = now() - start;
+    res->probe_ns = moves ? probe_secs * 1e9 / moves : 0;
+    res->probe_llc = !llc_valid ? -1 : moves ? probe_llc / moves : 0;
+    free(blocks);
+    free(sizes);
+}
+
+/*
+ * read_trace - read a trace file in the format mdriver reads
+ */
+static trace_t *read_trace(char *filename)
+{
+    FILE *fp;
+    trace_t *trace;
+    char type[MAXLINE];
+    int heap_size, weight, i;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+	fprintf(stderr, "copybench: could not open %s\n", filename);
+	exit(1);
+    }
+    if ((trace = malloc(sizeof(trace_t))) == NULL ||
+	fscanf(fp, "%d %d %d %d", &heap_size, &trace->num_ids,
+	       &trace->num_ops, &weight) != 4 ||
+	(trace->ops = malloc(trace->num_ops * sizeof(op_t))) == NULL) {
+	fprintf(stderr, "copybench: bad trace %s\n", filename);
+	exit(1);
+    }
+    for (i = 0; i < trace->num_ops && fscanf(fp, "%s", type) == 1; i++) {
+	op_t *op = &trace->ops[i];
+
+	op->type = type[0];
+	op->size = 0;
+	if (op->type == 'f' ? fscanf(fp, "%d", &op->index) != 1 :
+	    fscanf(fp, "%d %d", &op->index, &op->size) != 2) {
+	    fprintf(stderr, "copybench: bad request %d in %s\n", i, filename);
+	    exit(1);
+	}
+    }
+    trace->num_ops = i;
+    fclose(fp);
+    return trace;
+}
+
+/*
+ * streamed - Count the moves of trace of at least nt_min bytes, which a
+ *     build with that NT_COPY_MIN streams; 0 if nt_min is 0. Builds
+ *     with the same count stream the very same moves.
+ */
+static int streamed(trace_t *trace, int nt_min)
+{
+    int *sizes = calloc(trace->num_ids, sizeof(int));
+    int i, n = 0;
+
+    if (sizes == NULL) {
+	fprintf(stderr, "copybench: calloc failed\n");
+	exit(1);
+    }
+    for (i = 0; i < trace->num_ops; i++) {
+	op_t *op = &trace->ops[i];
+
+	if (op->type == 'r' && nt_min > 0 &&
+	    MIN(sizes[op->index], op->size) >= nt_min)
+	    n++;
+	sizes[op->index] = op->size;
+    }
+    free(sizes);
+    return n;
+}
+
+/*
+ * sweep_trace - A trace that moves blocks of size bytes, SWEEP_BYTES
+ *     in all. Each block is doubled by realloc with another block right
+ *     behind it, so that it cannot grow in place and has to move.
+ */
+static trace_t *sweep_trace(int size)
+{
+    trace_t *trace;
+    op_t *op;
+    int i, reps = MAX(4, SWEEP_BYTES / size);
+
+    if ((trace = malloc(sizeof(trace_t))) == NULL ||
+	(trace->ops = malloc(5 * reps * sizeof(op_t))) == NULL) {
+	fprintf(stderr, "copybench: malloc failed\n");
+	exit(1);
+    }
+    trace->num_ids = 2;
+    trace->num_ops = 5 * reps;
+    for (i = 0, op = trace->ops; i < reps; i++) {
+	*op++ = (op_t){'a', 0, size};
+	*op++ = (op_t){'a', 1, 64};
+	*op++ = (op_t){'r', 0, 2 * size};
+	*op++ = (op_t){'f', 1, 0};
+	*op++ = (op_t){'f', 0, 0};
+    }
+    return trace;
+}
+
+/*
+ * now - wall clock time in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: copybench [-m] [-k <hot KB>] [-n <runs>] [tracefile...]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-k <KB>    Size of the hot working set (default 256).\n");
+    fprintf(stderr, "\t-m         Also move blocks of %dK to %dK (default without\n",
+	    SWEEP_MIN >> 10, SWEEP_MAX >> 10);
+    fprintf(stderr, "\t           tracefiles).\n");
+    fprintf(stderr, "\t-n <runs>  Timed runs per trace, the fastest counts (default 5).\n");
+}
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <sys/times.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "fcyc.h"
 #include "clock.h"
@@ -113,6 +114,8 @@ static void clear()
 	    fprintf(stderr, "Fatal error.  Malloc returned null when trying to clear cache\n");
 	    exit(1);
 	}
+	/* Untouched pages all map the zero page and would evict nothing */
+	memset(cache_buf, 1, cache_bytes);
     }
     cptr = (int *) cache_buf;
     cend = cptr + cache_bytes/sizeof(int);
@@ -123,6 +126,15 @@ static void clear()
     sink = x;
 }
 
+/*
+ * fcyc_clear - Clear the cache the way fcyc does before each sample 
+ *     when set_fcyc_clear_cache is on, for timers of other kinds
+ */
+void fcyc_clear(void)
+{
+    clear();
+}
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
@@ -13,6 +13,9 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* Clear the cache, as fcyc does before each sample when told to */
+void fcyc_clear(void);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -2,13 +2,26 @@
  * High-level timing wrappers
  ****************************/
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
+#include "tsc.h"
+#include "tdist.h"
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static int use_tsc; /* USE_TSC, and this CPU has an invariant TSC */
+static int samples = FSECS_SAMPLES; /* timed runs of fsecs_stats */
+static int warmup = FSECS_WARMUP;   /* untimed runs before them */
+
+static double now(void);
+static int cmp_double(const void *a, const void *b);
+static double quantile(double *sorted, int n, double q);
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -30,6 +43,15 @@ void init_fsecs(void)
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
     Mhz = mhz(verbose > 0);
+#elif USE_TSC
+    if ((use_tsc = tsc_init())) {
+	if (verbose)
+	    printf("Measuring performance with the TSC (%.0f MHz).\n",
+		   tsc_hz() / 1e6);
+    }
+    else
+	printf("No TSC timer, %s. Measuring with gettimeofday().\n",
+	       tsc_error());
 #elif USE_ITIMER
     if (verbose)
 	printf("Measuring performance with the interval timer.\n");
@@ -47,6 +69,10 @@ double fsecs(fsecs_test_funct f, void *argp)
 #if USE_FCYC
     double cycles = fcyc(f, argp);
     return cycles/(Mhz*1e6);
+#elif USE_TSC
+    if (use_tsc)
+	return ftimer_tsc(f, argp, TSC_RUNS, TSC_MIN_SECS);
+    return ftimer_gettod(f, argp, 10);
 #elif USE_ITIMER
     return ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
@@ -54,4 +80,140 @@ double fsecs(fsecs_test_funct f, void *argp)
 #endif 
 }
 
+/*
+ * fsecs_stats - Time f(argp) over and over and keep every sample, 
+ *     where fsecs keeps one number. First FSECS_COLD runs each on a 
+ *     cache that fcyc_clear has emptied, then the warmup runs, which 
+ *     are not timed, then the samples, which summarize the warm runs. 
+ *     Outliers are counted, not dropped, so that a bimodal f shows up
+ *     as a wide interval and outliers rather than a small minimum.
+ */
+void fsecs_stats(fsecs_test_funct f, void *argp, fsecs_stats_t *st)
+{
+    static int cache_set;
+    double cold[FSECS_COLD], *secs, t, q1, q3, iqr, var = 0;
+    int i;
+
+    if ((secs = malloc(samples * sizeof(double))) == NULL) {
+	fprintf(stderr, "fsecs_stats: malloc failed\n");
+	exit(1);
+    }
+    if (!cache_set) {
+	/* Big enough to push the heap out of today's last level caches */
+	set_fcyc_cache_size(FSECS_CACHE_BYTES);
+	set_fcyc_cache_block(64);
+	cache_set = 1;
+    }
+
+    for (i = 0; i < FSECS_COLD; i++) {
+	fcyc_clear();
+	t = now();
+	f(argp);
+	cold[i] = now() - t;
+    }
+    for (i = 0; i < warmup; i++)
+	f(argp);
+    st->mean = 0;
+    for (i = 0; i < samples; i++) {
+	t = now();
+	f(argp);
+	secs[i] = now() - t;
+	st->mean += secs[i];
+    }
+
+    st->n = samples;
+    st->mean /= samples;
+    for (i = 0; i < samples; i++)
+	var += (secs[i] - st->mean) * (secs[i] - st->mean);
+    st->sd = samples > 1 ? sqrt(var / (samples - 1)) : 0;
+    st->ci95 = samples > 1 ? t_975(samples - 1) * st->sd / sqrt(samples) : 0;
+
+    qsort(secs, samples, sizeof(double), cmp_double);
+    /* The first run also faults the heap in; keep it apart */
+    st->cold_first = cold[0];
+    if (FSECS_COLD > 1)
+	qsort(cold + 1, FSECS_COLD - 1, sizeof(double), cmp_double);
+    st->median = quantile(secs, samples, 0.5);
+    st->min = secs[0];
+    st->max = secs[samples - 1];
+    st->cold = FSECS_COLD > 1 ? quantile(cold + 1, FSECS_COLD - 1, 0.5) 
+	: cold[0];
+    q1 = quantile(secs, samples, 0.25);
+    q3 = quantile(secs, samples, 0.75);
+    iqr = q3 - q1;
+    st->outliers = 0;
+    for (i = 0; i < samples; i++)
+	if (secs[i] < q1 - 1.5 * iqr || secs[i] > q3 + 1.5 * iqr)
+	    st->outliers++;
+    free(secs);
+}
+
+/* 
+ * set_fsecs_samples - Number of timed runs of fsecs_stats
+ *     Default = FSECS_SAMPLES
+ */
+void set_fsecs_samples(int n)
+{
+    samples = n;
+}
+
+/* 
+ * set_fsecs_warmup - Number of untimed runs before the samples
+ *     Default = FSECS_WARMUP
+ */
+void set_fsecs_warmup(int n)
+{
+    warmup = n;
+}
+
+/*
+ * now - Seconds on the TSC if we time with it, else on the raw 
+ *     monotonic clock
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    if (use_tsc)
+	return tsc_read() / tsc_hz();
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * quantile - The q quantile of n sorted values, interpolating between
+ *     the two nearest
+ */
+static double quantile(double *sorted, int n, double q)
+{
+    double pos = q * (n - 1);
+    int i = (int)pos;
+
+    if (i + 1 >= n)
+	return sorted[n - 1];
+    return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+/*
+ * fsecs_counters - Run f once more with the hardware counters on and
+ *     return the counts in pc. Returns 0 and leaves the counts invalid
+ *     if no counter can be opened, so the caller has wall time only.
+ */
+int fsecs_counters(fsecs_test_funct f, void *argp, pcounts_t *pc)
+{
+    if (perfctr_init() == 0) {
+	memset(pc, 0, sizeof(*pc));
+	return 0;
+    }
+    perfctr_start();
+    f(argp);
+    perfctr_stop(pc);
+    return 1;
+}
@@ -1,4 +1,26 @@
+#include "perfctr.h"
+
 typedef void (*fsecs_test_funct)(void *);
 
+/* 
+ * Every sample of a function's running time, in seconds, after some
+ * warmup runs (see fsecs_stats)
+ */
+typedef struct {
+    int n;           /* number of samples */
+    double mean;
+    double median;
+    double sd;       /* standard deviation */
+    double ci95;     /* half width of the 95% confidence interval of mean */
+    double min, max;
+    int outliers;    /* samples beyond the Tukey fences */
+    double cold_first; /* first run on a cleared cache */
+    double cold;     /* median of the other runs on a cleared cache */
+} fsecs_stats_t;
+
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+void fsecs_stats(fsecs_test_funct f, void *argp, fsecs_stats_t *st);
+void set_fsecs_samples(int n);
+void set_fsecs_warmup(int n);
+int fsecs_counters(fsecs_test_funct f, void *argp, pcounts_t *pc);
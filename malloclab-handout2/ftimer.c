@@ -7,14 +7,20 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_tsc: version that uses the time stamp counter (see tsc.h)
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/time.h>
 #include "ftimer.h"
+#include "tsc.h"
+
+#define TSC_MAXRUNS 1000  /* most runs ftimer_tsc keeps */
 
 /* function prototypes */
 static void init_etime(void);
 static double get_etime(void);
+static int cmp_double(const void *a, const void *b);
 
 /* 
  * ftimer_itimer - Use the interval timer to estimate the running time
@@ -52,6 +58,39 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/*
+ * ftimer_tsc - Use the time stamp counter to estimate the running time
+ * of f(argp). Times every run on its own, at least n runs and until
+ * min_secs have gone by, and returns the median, which a stray 
+ * interrupt or page fault does not move. tsc_init must have succeeded.
+ */
+double ftimer_tsc(ftimer_test_funct f, void *argp, int n, double min_secs)
+{
+    static double secs[TSC_MAXRUNS];
+    unsigned long long start, end, until;
+    double hz = tsc_hz();
+    int i;
+
+    until = tsc_read() + (unsigned long long)(min_secs * hz);
+    for (i = 0; i < TSC_MAXRUNS; i++) {
+	start = tsc_read();
+	f(argp);
+	end = tsc_read();
+	secs[i] = (end - start) / hz;
+	if (i + 1 >= n && end >= until)
+	    break;
+    }
+    n = i < TSC_MAXRUNS ? i + 1 : TSC_MAXRUNS;
+    qsort(secs, n, sizeof(double), cmp_double);
+    return secs[n / 2];
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
 
 /*
  * Routines for manipulating the Unix interval timer
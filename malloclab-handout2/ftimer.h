@@ -12,3 +12,6 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+/* Estimate the running time of f(argp) with the time stamp counter.
+   Return the median of at least n runs that take min_secs together */
+double ftimer_tsc(ftimer_test_funct f, void *argp, int n, double min_secs);
@@ -0,0 +1,589 @@
+/*
+ * gentrace.c - Generate allocator traces from a workload spec
+ *
+ * usage: gentrace [-s <seed>] [-o <out>] <spec>
+ *
+ * Writes a balanced trace (every block is freed by the end) in .rep
+ * format, or in the binary format of tracebin.h when the output name
+ * ends in .bin. The same spec and seed always give the same trace.
+ *
+ * A spec is a text file with one setting per line, # starts a comment
+ * and sizes take a K, M or G suffix:
+ *
+ *   seed <n>                 random seed (default 1, -s overrides it)
+ *   peak <bytes>             live bytes to stay under, by freeing the
+ *                            blocks that die soonest early (default none)
+ *   phase [<name>]           start a new phase, which begins with the
+ *                            settings of the one before; the lines
+ *                            below apply to it
+ *   allocs <n>               allocations in the phase (default 10000)
+ *   size fixed <n>           request sizes (default fixed 64)
+ *   size uniform <lo> <hi>
+ *   size lognormal <median> <sigma>
+ *   size zipf <s> <size>...  the k-th listed size with weight 1/k^s
+ *   life fixed <n>           block lifetimes, counted in allocations
+ *   life uniform <lo> <hi>   (default exp 1000)
+ *   life exp <mean>
+ *   life forever             live until the end of the trace
+ *   realloc <p> <n> geom <factor>     with probability p a block is
+ *   realloc <p> <n> linear <bytes>    reallocated n times over its life,
+ *   realloc none                      growing by factor or by bytes
+ *
+ * For example, a service that warms a cache of long lived objects and
+ * then serves requests that build growing buffers:
+ *
+ *   seed 7
+ *   peak 512M
+ *   phase warmup
+ *   allocs 200000
+ *   size zipf 1.1 16 32 64 128 256 512 1024 4096
+ *   life forever
+ *   phase serve
+ *   allocs 5M
+ *   size lognormal 96 1.5
+ *   life exp 2000
+ *   realloc 0.05 4 geom 2
+ *
+ * Time is counted in allocations. Every free and realloc is an event
+ * in a heap ordered by time, and the events up to the current time are
+ * written out before each allocation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+
+#include "tracebin.h"
+
+#define MAXLINE    1024
+#define MAXCLASSES 64
+#define MAXPHASES  64
+#define MAXSIZE    INT_MAX      /* largest request a trace can hold */
+#define FOREVER    (~0ULL)
+#define REP_FIELD  20           /* width of a .rep header field */
+#define CLAMP_INT(x) ((x) > INT_MAX ? INT_MAX : (int)(x))
+
+enum {FIXED, UNIFORM, LOGNORMAL, ZIPF, EXP, NEVER};
+enum {NONE, GEOM, LINEAR};
+
+/* One phase of the workload */
+typedef struct {
+    char name[32];
+    long allocs;
+    int size_kind;
+    double size_a, size_b;          /* parameters of the size distribution */
+    int num_classes;                /* zipf: sizes and cumulative weights */
+    double classes[MAXCLASSES];
+    double cdf[MAXCLASSES];
+    int life_kind;
+    double life_a, life_b;
+    double realloc_p;
+    int realloc_n;
+    int realloc_kind;
+    double realloc_arg;
+} phase_t;
+
+/* A pending free or realloc */
+typedef struct {
+    unsigned long long key;         /* time * 2, +1 for a free */
+    unsigned id;
+} event_t;
+
+/* Globals */
+static phase_t phases[MAXPHASES];
+static int num_phases;
+static unsigned long long seed = 1;
+static double peak;                 /* 0 for no limit */
+
+static event_t *events;             /* binary min heap of events */
+static long num_events, max_events;
+
+static unsigned *sizes;             /* current size of each id */
+static unsigned char *live;         /* is the id allocated? */
+static long num_ids, max_ids;
+
+static FILE *out;
+static int binary;                  /* write the tracebin format? */
+static long num_ops;
+static double live_bytes, max_live;
+static unsigned long long rng_state;
+
+static void read_spec(char *filename);
+static void generate(void);
+static void emit(int type, unsigned id, unsigned size);
+static void run_event(event_t *e);
+static void push_event(unsigned long long key, unsigned id);
+static void pop_event(event_t *e);
+static unsigned draw_size(phase_t *ph);
+static unsigned long long draw_life(phase_t *ph);
+static double rnd(void);
+static double parse_num(char *s, char *filename, int line);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    char *outname = NULL;
+    char *seed_arg = NULL;
+    char header[4 * (REP_FIELD + 1) + 1];
+    int c, len;
+
+    while ((c = getopt(argc, argv, "s:o:h")) != EOF) {
+	switch (c) {
+	case 's':
+	    seed_arg = optarg;
+	    break;
+	case 'o':
+	    outname = optarg;
+	    break;
+	case 'h':
+	default:
+	    usage();
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (optind != argc - 1 || outname == NULL) {
+	usage();
+	exit(1);
+    }
+    read_spec(argv[optind]);
+    if (seed_arg != NULL)
+	seed = strtoull(seed_arg, NULL, 0);
+    rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    len = strlen(outname);
+    binary = len > 4 && !strcmp(outname + len - 4, ".bin");
+    if ((out = fopen(outname, "w")) == NULL) {
+	fprintf(stderr, "gentrace: could not create %s\n", outname);
+	exit(1);
+    }
+
+    /* The header is only known at the end, so leave room for it */
+    if (binary)
+	tb_write_header(out, 0, 0, 0, 0);
+    else
+	fprintf(out, "%*s", 4 * (REP_FIELD + 1), "");
+    generate();
+
+    rewind(out);
+    if (binary)
+	tb_write_header(out, CLAMP_INT(max_live), num_ids, num_ops, 1);
+    else {
+	sprintf(header, "%-*d\n%-*ld\n%-*ld\n%-*d\n", REP_FIELD,
+		CLAMP_INT(max_live), REP_FIELD, num_ids, REP_FIELD,
+		num_ops, REP_FIELD, 1);
+	fputs(header, out);
+    }
+    if (fclose(out) != 0) {
+	fprintf(stderr, "gentrace: could not write %s\n", outname);
+	exit(1);
+    }
+    printf("%s: %ld ids, %ld requests, peak %.1f MB live\n", outname,
+	   num_ids, num_ops, max_live / (1 << 20));
+    exit(0);
+}
+
+/*
+ * generate - Write the requests of all phases, then free what is left
+ */
+static void generate(void)
+{
+    unsigned long long now = 0, life, t;
+    event_t e;
+    phase_t *ph;
+    unsigned size, id;
+    long i;
+    int p, j;
+
+    for (p = 0; p < num_phases; p++) {
+	ph = &phases[p];
+	for (i = 0; i < ph->allocs; i++, now++) {
+	    /* Catch up with everything that is due */
+	    while (num_events > 0 && events[0].key <= 2 * now + 1) {
+		pop_event(&e);
+		run_event(&e);
+	    }
+
+	    /* Bring deaths forward while the block would go over peak */
+	    size = draw_size(ph);
+	    while (peak > 0 && live_bytes + size > peak && num_events > 0) {
+		pop_event(&e);
+		run_event(&e);
+	    }
+
+	    if (num_ids == max_ids) {
+		max_ids = max_ids ? 2 * max_ids : 1024;
+		sizes = realloc(sizes, max_ids * sizeof(unsigned));
+		live = realloc(live, max_ids);
+		if (sizes == NULL || live == NULL) {
+		    fprintf(stderr, "gentrace: out of memory\n");
+		    exit(1);
+		}
+	    }
+	    id = num_ids++;
+	    live[id] = 1;
+	    sizes[id] = size;
+	    emit(TB_ALLOC, id, size);
+
+	    /* Schedule the reallocs over its life, then its death */
+	    life = draw_life(ph);
+	    if (ph->realloc_kind != NONE && rnd() < ph->realloc_p)
+		for (j = 1; j <= ph->realloc_n; j++) {
+		    t = life == FOREVER ? now + 1000 * j : 
+			now + life * j / (ph->realloc_n + 1);
+		    push_event(2 * t, id);
+		}
+	    if (life != FOREVER)
+		push_event(2 * (now + life) + 1, id);
+	}
+    }
+
+    /* Run out the clock, then free the blocks that live forever */
+    while (num_events > 0) {
+	pop_event(&e);
+	run_event(&e);
+    }
+    for (id = 0; id < num_ids; id++)
+	if (live[id]) {
+	    e.key = 1;
+	    e.id = id;
+	    run_event(&e);
+	}
+}
+
+/*
+ * run_event - Write the free or realloc that e stands for. A realloc
+ *     grows the block as the phase that was current when it was
+ *     scheduled says; the phase is found from the block id.
+ */
+static void run_event(event_t *e)
+{
+    unsigned id = e->id;
+    phase_t *ph;
+    double size;
+    long first;
+    int p;
+
+    if (!live[id])
+	return;
+    if (e->key & 1) {
+	emit(TB_FREE, id, 0);
+	live[id] = 0;
+	return;
+    }
+
+    /* Find the phase the block was allocated in */
+    for (p = 0, first = 0; p < num_phases - 1; p++) {
+	if (id < first + phases[p].allocs)
+	    break;
+	first += phases[p].allocs;
+    }
+    ph = &phases[p];
+    size = ph->realloc_kind == GEOM ? sizes[id] * ph->realloc_arg : 
+	sizes[id] + ph->realloc_arg;
+    if (size < 1)
+	size = 1;
+    if (size > MAXSIZE)
+	size = MAXSIZE;
+    emit(TB_REALLOC, id, (unsigned)size);
+}
+
+/*
+ * emit - Write one request and keep track of the live bytes
+ */
+static void emit(int type, unsigned id, unsigned size)
+{
+    switch (type) {
+    case TB_ALLOC:
+	live_bytes += size;
+	break;
+    case TB_REALLOC:
+	live_bytes += (double)size - sizes[id];
+	sizes[id] = size;
+	break;
+    case TB_FREE:
+	live_bytes -= sizes[id];
+	break;
+    }
+    if (live_bytes > max_live)
+	max_live = live_bytes;
+    num_ops++;
+
+    if (binary)
+	tb_write_op(out, type, id, size);
+    else if (type == TB_FREE)
+	fprintf(out, "f %u\n", id);
+    else
+	fprintf(out, "%c %u %u\n", type == TB_ALLOC ? 'a' : 'r', id, size);
+}
+
+/*
+ * push_event, pop_event - The event heap, earliest key on top
+ */
+static void push_event(unsigned long long key, unsigned id)
+{
+    long i = num_events++;
+    event_t e;
+
+    if (num_events > max_events) {
+	max_events = max_events ? 2 * max_events : 1024;
+	if ((events = realloc(events, max_events * sizeof(event_t))) == NULL) {
+	    fprintf(stderr, "gentrace: out of memory\n");
+	    exit(1);
+	}
+    }
+    e.key = key;
+    e.id = id;
+    while (i > 0 && events[(i - 1) / 2].key > key) {
+	events[i] = events[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    events[i] = e;
+}
+
+static void pop_event(event_t *e)
+{
+    event_t last = events[--num_events];
+    long i = 0, child;
+
+    *e = events[0];
+    while ((child = 2 * i + 1) < num_events) {
+	if (child + 1 < num_events && events[child + 1].key < events[child].key)
+	    child++;
+	if (last.key <= events[child].key)
+	    break;
+	events[i] = events[child];
+	i = child;
+    }
+    events[i] = last;
+}
+
+/*
+ * draw_size - A request size from the phase's size distribution
+ */
+static unsigned draw_size(phase_t *ph)
+{
+    double size = ph->size_a, u;
+    int k;
+
+    switch (ph->size_kind) {
+    case UNIFORM:
+	size = ph->size_a + floor(rnd() * (ph->size_b - ph->size_a + 1));
+	break;
+    case LOGNORMAL: /* Box-Muller */
+	u = rnd();
+	size = ph->size_a * exp(ph->size_b * sqrt(-2 * log(1 - u)) * 
+				cos(2 * M_PI * rnd()));
+	break;
+    case ZIPF:
+	u = rnd() * ph->cdf[ph->num_classes - 1];
+	for (k = 0; k < ph->num_classes - 1 && ph->cdf[k] < u; k++)
+	    ;
+	size = ph->classes[k];
+	break;
+    }
+    if (size < 1)
+	size = 1;
+    if (size > MAXSIZE)
+	size = MAXSIZE;
+    return (unsigned)size;
+}
+
+/*
+ * draw_life - A lifetime in allocations, or FOREVER
+ */
+static unsigned long long draw_life(phase_t *ph)
+{
+    switch (ph->life_kind) {
+    case UNIFORM:
+	return ph->life_a + floor(rnd() * (ph->life_b - ph->life_a + 1));
+    case EXP:
+	return floor(-ph->life_a * log(1 - rnd()));
+    case NEVER:
+	return FOREVER;
+    default:
+	return ph->life_a;
+    }
+}
+
+/*
+ * rnd - Uniform in [0, 1) from xorshift64*, so that a seed gives the
+ *     same trace with any libc
+ */
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+/*
+ * read_spec - Parse the workload spec into phases[]
+ */
+static void read_spec(char *filename)
+{
+    FILE *fp;
+    char buf[MAXLINE];
+    char *argv[MAXCLASSES + 2];
+    phase_t *ph = NULL;
+    int line = 0, argc, k;
+    char *tok;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+	fprintf(stderr, "gentrace: could not open %s\n", filename);
+	exit(1);
+    }
+    while (fgets(buf, MAXLINE, fp) != NULL) {
+	line++;
+	if ((tok = strchr(buf, '#')) != NULL)
+	    *tok = '\0';
+	for (argc = 0, tok = strtok(buf, " \t\r\n"); 
+	     tok != NULL && argc < MAXCLASSES + 2; 
+	     tok = strtok(NULL, " \t\r\n"))
+	    argv[argc++] = tok;
+	if (argc == 0)
+	    continue;
+
+	if (!strcmp(argv[0], "seed") && argc == 2) {
+	    seed = strtoull(argv[1], NULL, 0);
+	    continue;
+	}
+	if (!strcmp(argv[0], "peak") && argc == 2) {
+	    peak = parse_num(argv[1], filename, line);
+	    continue;
+	}
+
+	/* Everything else sets up a phase, there is one even without a phase line */
+	if (ph == NULL || !strcmp(argv[0], "phase")) {
+	    if (num_phases == MAXPHASES) {
+		fprintf(stderr, "%s:%d: too many phases\n", filename, line);
+		exit(1);
+	    }
+	    if (ph == NULL) {
+		ph = &phases[num_phases++];
+		ph->allocs = 10000;
+		ph->size_kind = FIXED;
+		ph->size_a = 64;
+		ph->life_kind = EXP;
+		ph->life_a = 1000;
+		ph->realloc_kind = NONE;
+	    }
+	    else {
+		phases[num_phases] = *ph;
+		ph = &phases[num_phases++];
+	    }
+	    if (!strcmp(argv[0], "phase")) {
+		snprintf(ph->name, sizeof(ph->name), "%s", argc > 1 ? argv[1] : "");
+		continue;
+	    }
+	}
+
+	if (!strcmp(argv[0], "allocs") && argc == 2)
+	    ph->allocs = (long)parse_num(argv[1], filename, line);
+	else if (!strcmp(argv[0], "size") && argc >= 3) {
+	    if (!strcmp(argv[1], "fixed") && argc == 3)
+		ph->size_kind = FIXED;
+	    else if (!strcmp(argv[1], "uniform") && argc == 4)
+		ph->size_kind = UNIFORM;
+	    else if (!strcmp(argv[1], "lognormal") && argc == 4)
+		ph->size_kind = LOGNORMAL;
+	    else if (!strcmp(argv[1], "zipf") && argc >= 4 && 
+		     argc - 3 <= MAXCLASSES)
+		ph->size_kind = ZIPF;
+	    else
+		goto bad;
+	    ph->size_a = parse_num(argv[2], filename, line);
+	    if (ph->size_kind == UNIFORM || ph->size_kind == LOGNORMAL)
+		ph->size_b = parse_num(argv[3], filename, line);
+	    if (ph->size_kind == ZIPF) {
+		ph->num_classes = argc - 3;
+		for (k = 0; k < ph->num_classes; k++) {
+		    ph->classes[k] = parse_num(argv[k + 3], filename, line);
+		    ph->cdf[k] = (k ? ph->cdf[k - 1] : 0) + 
+			1 / pow(k + 1, ph->size_a);
+		}
+	    }
+	}
+	else if (!strcmp(argv[0], "life") && argc >= 2) {
+	    if (!strcmp(argv[1], "fixed") && argc == 3)
+		ph->life_kind = FIXED;
+	    else if (!strcmp(argv[1], "uniform") && argc == 4)
+		ph->life_kind = UNIFORM;
+	    else if (!strcmp(argv[1], "exp") && argc == 3)
+		ph->life_kind = EXP;
+	    else if (!strcmp(argv[1], "forever") && argc == 2)
+		ph->life_kind = NEVER;
+	    else
+		goto bad;
+	    if (argc > 2)
+		ph->life_a = parse_num(argv[2], filename, line);
+	    if (argc > 3)
+		ph->life_b = parse_num(argv[3], filename, line);
+	}
+	else if (!strcmp(argv[0], "realloc") && argc == 2 && 
+		 !strcmp(argv[1], "none"))
+	    ph->realloc_kind = NONE;
+	else if (!strcmp(argv[0], "realloc") && argc == 5) {
+	    if (!strcmp(argv[3], "geom"))
+		ph->realloc_kind = GEOM;
+	    else if (!strcmp(argv[3], "linear"))
+		ph->realloc_kind = LINEAR;
+	    else
+		goto bad;
+	    ph->realloc_p = atof(argv[1]);
+	    ph->realloc_n = atoi(argv[2]);
+	    ph->realloc_arg = parse_num(argv[4], filename, line);
+	}
+	else
+	    goto bad;
+	continue;
+    bad:
+	fprintf(stderr, "%s:%d: bad setting %s\n", filename, line, argv[0]);
+	exit(1);
+    }
+    fclose(fp);
+    if (num_phases == 0) {
+	fprintf(stderr, "gentrace: %s sets up no allocations\n", filename);
+	exit(1);
+    }
+}
+
+/*
+ * parse_num - A number with an optional K, M or G suffix
+ */
+static double parse_num(char *s, char *filename, int line)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    switch (*end) {
+    case 'K': case 'k':
+	v *= 1 << 10;
+	end++;
+	break;
+    case 'M': case 'm':
+	v *= 1 << 20;
+	end++;
+	break;
+    case 'G': case 'g':
+	v *= 1 << 30;
+	end++;
+	break;
+    }
+    if (end == s || *end != '\0' || v < 0) {
+	fprintf(stderr, "%s:%d: bad number %s\n", filename, line, s);
+	exit(1);
+    }
+    return v;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-s <seed>] -o <out.rep|out.bin> <spec>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-o <file>  Trace to write, binary if it ends in .bin.\n");
+    fprintf(stderr, "\t-s <seed>  Random seed, overrides the spec's.\n");
+}
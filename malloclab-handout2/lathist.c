@@ -0,0 +1,104 @@
+/*
+ * lathist.c - Log-linear latency histograms (see lathist.h)
+ */
+#include <string.h>
+
+#include "lathist.h"
+
+#define CALIBRATE_SAMPLES 10001   /* clock read pairs lat_overhead times */
+
+/*
+ * bucket - Index of the bucket that holds ns. Below 2*LAT_SUB each
+ *     value has its own bucket; above, the value is cut down to its
+ *     top LAT_SUB_BITS+1 bits and shift says by how much.
+ */
+static int bucket(lat_t ns)
+{
+    int shift;
+
+    if (ns < 2 * LAT_SUB)
+	return (int)ns;
+    shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift << LAT_SUB_BITS) + (int)(ns >> shift);
+}
+
+/*
+ * bucket_high - Largest value that falls in bucket i
+ */
+static lat_t bucket_high(int i)
+{
+    int shift = (i >> LAT_SUB_BITS) - 1;
+
+    if (shift < 1)
+	return (lat_t)i;
+    return (((lat_t)(i & (LAT_SUB - 1)) + LAT_SUB + 1) << shift) - 1;
+}
+
+void lat_reset(lathist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void lat_record(lathist_t *h, lat_t ns)
+{
+    h->count[bucket(ns)]++;
+    h->n++;
+    if (ns > h->max)
+	h->max = ns;
+}
+
+/*
+ * lat_merge - Add the values of src to dst
+ */
+void lat_merge(lathist_t *dst, const lathist_t *src)
+{
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+	dst->count[i] += src->count[i];
+    dst->n += src->n;
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+/*
+ * lat_percentile - The value that p percent of the values are at or
+ *     below, rounded up to the top of its bucket but never above the
+ *     largest value. 0 for an empty histogram.
+ */
+lat_t lat_percentile(const lathist_t *h, double p)
+{
+    lat_t rank, seen = 0;
+    int i;
+
+    if (h->n == 0)
+	return 0;
+    rank = (lat_t)(p / 100 * h->n + 0.5);
+    if (rank < 1)
+	rank = 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	seen += h->count[i];
+	if (seen >= rank)
+	    return bucket_high(i) < h->max ? bucket_high(i) : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * lat_overhead - The median time between two back to back lat_now
+ *     calls, which is what timing a request adds to its latency
+ */
+lat_t lat_overhead(void)
+{
+    static lathist_t h;
+    lat_t t0, t1;
+    int i;
+
+    lat_reset(&h);
+    for (i = 0; i < CALIBRATE_SAMPLES; i++) {
+	t0 = lat_now();
+	t1 = lat_now();
+	lat_record(&h, t1 - t0);
+    }
+    return lat_percentile(&h, 50);
+}
@@ -0,0 +1,191 @@
+/*
+ * linebench.c - Show what false sharing costs threads that count in
+ * blocks from mm_malloc.
+ *
+ * Every thread increments a counter of its own in a block from the bg
+ * policy of mm.c, the one that is safe to call from several threads.
+ * The counters are allocated three ways:
+ *
+ *   packed  one thread allocates them all with mm_malloc, so they end
+ *           up next to each other and share cache lines
+ *   flag    one thread allocates them all with MM_ALIGN_LINE
+ *   auto    every thread allocates its own with mm_malloc, in turn,
+ *           which LINE_AUTO turns into MM_ALIGN_LINE
+ *
+ * usage: linebench [-t <threads>] [-n <increments>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mm-policy.h"
+#include "mm.h"
+#include "memlib.h"
+
+#define MAXTHREADS 64
+
+/* What one counting thread needs */
+typedef struct {
+    int id;
+    volatile long *counter;
+} worker_t;
+
+static int num_threads = 4;
+static long num_incs = 10000000;
+static int auto_mode;                   /* threads allocate themselves */
+static int turn;                        /* whose turn it is to allocate */
+static pthread_mutex_t turn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+static pthread_barrier_t start;
+
+static void *count(void *arg);
+static void run(char *mode, int flags);
+static double now(void);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:h")) != EOF) {
+	switch (c) {
+	case 't':
+	    num_threads = atoi(optarg);
+	    break;
+	case 'n':
+	    num_incs = atol(optarg);
+	    break;
+	case 'h':
+	default:
+	    usage();
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (num_threads < 1 || num_threads > MAXTHREADS || num_incs < 1) {
+	usage();
+	exit(1);
+    }
+
+    mem_init();
+    printf("%d threads, %ld increments each, %d byte lines\n\n",
+	   num_threads, num_incs, LINE_SIZE);
+    printf("%-8s %6s %10s %12s %8s\n", "mode", "lines", "secs",
+	   "Mincs/s", "speedup");
+    run("packed", 0);
+    run("flag", MM_ALIGN_LINE);
+    auto_mode = 1;
+    run("auto", 0);
+    mm_bg_deinit();
+    mem_deinit();
+    exit(0);
+}
+
+/*
+ * run - Allocate the counters in a fresh heap as mode says, let the
+ *     threads count and print a line of results, with the speedup
+ *     over the first run.
+ */
+static void run(char *mode, int flags)
+{
+    static double base;
+    pthread_t tids[MAXTHREADS];
+    worker_t workers[MAXTHREADS];
+    long lines[MAXTHREADS];
+    int i, j, num_lines = 0;
+    double t;
+
+    mm_bg_deinit();   /* stops the helper thread touching the old heap */
+    mem_reset_brk();
+    if (mm_bg_init() < 0) {
+	fprintf(stderr, "linebench: mm_bg_init failed\n");
+	exit(1);
+    }
+    turn = 0;
+    for (i = 0; i < num_threads; i++) {
+	workers[i].id = i;
+	workers[i].counter = NULL;
+	if (!auto_mode)
+	    workers[i].counter = mm_bg_malloc_flags(sizeof(long), flags);
+    }
+
+    pthread_barrier_init(&start, NULL, num_threads + 1);
+    for (i = 0; i < num_threads; i++)
+	if (pthread_create(&tids[i], NULL, count, &workers[i]) != 0) {
+	    fprintf(stderr, "linebench: pthread_create failed\n");
+	    exit(1);
+	}
+    pthread_barrier_wait(&start);
+    t = now();
+    for (i = 0; i < num_threads; i++)
+	pthread_join(tids[i], NULL);
+    t = now() - t;
+    pthread_barrier_destroy(&start);
+
+    /* How many lines the counters are spread over */
+    for (i = 0; i < num_threads; i++) {
+	long line = (long)workers[i].counter / LINE_SIZE;
+
+	for (j = 0; j < num_lines && lines[j] != line; j++)
+	    ;
+	if (j == num_lines)
+	    lines[num_lines++] = line;
+	if (*workers[i].counter != num_incs) {
+	    fprintf(stderr, "linebench: counter %d is %ld\n", i,
+		    *workers[i].counter);
+	    exit(1);
+	}
+    }
+    if (base == 0)
+	base = t;
+    printf("%-8s %6d %10.3f %12.1f %7.2fx\n", mode, num_lines, t,
+	   num_threads * num_incs / t / 1e6, base / t);
+}
+
+/*
+ * count - Body of a counting thread. In auto mode the threads first
+ *     allocate their counters one after the other.
+ */
+static void *count(void *arg)
+{
+    worker_t *w = arg;
+    volatile long *counter;
+    long i;
+
+    if (auto_mode) {
+	pthread_mutex_lock(&turn_lock);
+	while (turn != w->id)
+	    pthread_cond_wait(&turn_cond, &turn_lock);
+	w->counter = mm_bg_malloc(sizeof(long));
+	turn++;
+	pthread_cond_broadcast(&turn_cond);
+	pthread_mutex_unlock(&turn_lock);
+    }
+    counter = w->counter;
+    *counter = 0;
+    pthread_barrier_wait(&start);
+    for (i = 0; i < num_incs; i++)
+	(*counter)++;
+    return NULL;
+}
+
+/*
+ * now - wall clock time in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: linebench [-t <threads>] [-n <increments>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "\t-t <n>      Number of counting threads (default 4).\n");
+    fprintf(stderr, "\t-n <n>      Increments per thread (default 10000000).\n");
+}
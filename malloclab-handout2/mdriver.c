@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE     /* for tdestroy */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,11 +15,22 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
+#include <search.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "tracebin.h"
+#include "lathist.h"
 #include "fsecs.h"
+#include "tdist.h"
 #include "config.h"
 
 /**********************
@@ -29,6 +41,10 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXTHREADS    64 /* most threads in a multi-threaded replay (-T) */
+#define MT_RUNS        3 /* multi-threaded replays per count, fastest counts */
+#define MAXJOBS      256 /* most traces evaluated at once (-j) */
+#define NUM_PCTS       4 /* latency percentiles reported, see lat_pcts */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
@@ -37,11 +53,13 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The records are kept in
+ * a tsearch tree ordered by address, see range_compare.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
@@ -57,11 +75,59 @@ typedef struct {
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, or NULL when... */
+    tb_map_t bin;        /* ... they are replayed from a mapped binary trace */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/*
+ * Walks the requests of a trace, from the ops array or by decoding
+ * them from the mapped binary trace (see start_ops and next_op)
+ */
+typedef struct {
+    traceop_t *ops;           /* next request of a .rep trace... */
+    const unsigned char *p;   /* ... or of a binary trace */
+    const unsigned char *end;
+    int num_ids;
+    traceop_t op;             /* the last request decoded */
+} opcursor_t;
+
+/*
+ * A block that is allocated in a streamed replay (-S). Only the live
+ * blocks are kept, in an open addressing table keyed by id, so the
+ * replay needs memory for the live heap rather than for every id.
+ */
+typedef struct {
+    char *p;              /* the payload, NULL for an empty slot */
+    unsigned id;
+    int size;
+} live_t;
+
+typedef struct {
+    live_t *slots;        /* linear probing */
+    unsigned size;        /* number of slots, a power of two */
+    unsigned used;
+} livemap_t;
+
+/*
+ * Reads the requests of a streamed trace (-S) on a thread of its own,
+ * a chunk at a time, into two buffers that it and the replay take
+ * turns with
+ */
+typedef struct {
+    FILE *fp;
+    int binary;           /* tracebin.h format, or .rep text? */
+    traceop_t *buf[2];
+    int len[2];           /* requests in each buffer, 0 at the end */
+    int full[2];          /* filled and not yet replayed? */
+    int cur;              /* the buffer the replay is on, -1 at first */
+    int stop;             /* the replay is done with the trace */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t tid;
+} opstream_t;
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -69,7 +135,7 @@ typedef struct {
  */
 typedef struct {
     trace_t *trace;  
-    range_t *ranges;
+    void *ranges;    /* tree of range_t */
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -81,10 +147,81 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double secs_sd;  /* standard deviation of secs, 0 if not measured */
+    pcounts_t pc;    /* hardware counts for one replay (-P) */
+    lat_t lat[3][NUM_PCTS]; /* latency percentiles by request type (-L)... */
+    lat_t lat_n[3];         /* ... and the number of requests of the type */
+    fsecs_stats_t ts;       /* every sample of secs (-s) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/*
+ * The entry points of one allocator on the memlib heap: a policy
+ * instantiation of mm.c (see mm-policy.h), or another allocator built
+ * with its names prefixed (see mm-prefix.h)
+ */
+typedef struct {
+    char *name;                            /* name used with -p */
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*deinit)(void);
+    int threads;                           /* safe to call from threads? */
+    void (*heapstats)(mm_heapstats_t *hs); /* NULL if it keeps no stats */
+} mm_policy_t;
+
+/*
+ * The requests one thread replays in the multi-threaded mode (-T). A
+ * trace is split into shards by block id, and each shard keeps its
+ * requests in trace order. The size of a free is the number of allocs
+ * and reallocs of its id that must be done before it.
+ */
+typedef struct {
+    struct mtreplay *mt;  /* the replay this shard belongs to */
+    traceop_t *ops;       /* requests of the shard... */
+    int num_ops;          /* ... and their number */
+    pthread_t tid;
+} shard_t;
+
+/* One multi-threaded replay of a trace */
+typedef struct mtreplay {
+    trace_t *trace;
+    int num_threads;
+    shard_t shards[MAXTHREADS];
+    volatile int *done;   /* allocs and reallocs done on each id so far */
+    pthread_barrier_t start;
+} mtreplay_t;
+
+/*
+ * What evaluating one trace gives back. A worker process (-j) sends it
+ * to the driver over a pipe, followed by its latency histograms with -L.
+ */
+typedef struct {
+    int errors;                      /* errors found in the trace */
+    stats_t stats;
+    double mt_secs[MAXTHREADS + 1];  /* replay time by number of threads */
+} result_t;
+
+/* The result of one trace in a baseline run (-b) */
+typedef struct {
+    char policy[32];
+    char trace[MAXLINE];
+    int valid;
+    double util;
+    double secs;
+    double secs_sd;
+    int runs;        /* timing samples behind secs and secs_sd, 0 if no -s */
+} baseline_t;
+
+/* A worker process evaluating one trace (-j) */
+typedef struct {
+    pid_t pid;
+    int fd;               /* read end of its pipe, -1 for a free slot */
+    int tracenum;
+} worker_t;
+
 /********************
  * Global variables
  *******************/
@@ -100,20 +237,106 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* The policy instantiations of mm.c that are linked into the driver */
+static mm_policy_t policies[] = {
+    {"first", mm_init, mm_malloc, mm_free, mm_realloc, mm_deinit, 0,
+     mm_heapstats},
+    {"seg", mm_seg_init, mm_seg_malloc, mm_seg_free, mm_seg_realloc,
+     mm_seg_deinit, 0, mm_seg_heapstats},
+    {"best", mm_best_init, mm_best_malloc, mm_best_free, mm_best_realloc,
+     mm_best_deinit, 0, mm_best_heapstats},
+    {"pf", mm_pf_init, mm_pf_malloc, mm_pf_free, mm_pf_realloc,
+     mm_pf_deinit, 0, mm_pf_heapstats},
+    {"bg", mm_bg_init, mm_bg_malloc, mm_bg_free, mm_bg_realloc,
+     mm_bg_deinit, 1, mm_bg_heapstats},
+    {"adapt", mm_adapt_init, mm_adapt_malloc, mm_adapt_free, mm_adapt_realloc,
+     mm_adapt_deinit, 0, mm_adapt_heapstats},
+    {"segmt", mm_segmt_init, mm_segmt_malloc, mm_segmt_free, mm_segmt_realloc,
+     mm_segmt_deinit, 1, mm_segmt_heapstats},
+    {"ff", mm_ff_init, mm_ff_malloc, mm_ff_free, mm_ff_realloc,
+     mm_ff_deinit, 0, mm_ff_heapstats},
+    {NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL}
+};
+#define NUM_POLICIES (sizeof(policies) / sizeof(mm_policy_t) - 1)
+
+/* The policy under evaluation */
+static mm_policy_t *mm = &policies[0];
+
+/* How to evaluate each trace, set on the command line */
+static int num_threads = 0;   /* most threads to replay with (-T), 0 if off */
+static int cross = 0;         /* free blocks from other threads (-x) */
+static int latency = 0;       /* time every request (-L) */
+static lat_t lat_ovhd = 0;    /* what timing a request adds to it */
+static int counters = 0;      /* read the hardware counters (-P) */
+static int num_jobs = 0;      /* traces to evaluate at once (-j), 0 if off */
+static int pin = 0;           /* pin each worker to a CPU of its own (-c) */
+static int sampling = 0;      /* keep every sample of the time (-s) */
+static int streaming = 0;     /* replay traces as they are read (-S) */
+static double touch = 0;      /* part of each payload to touch (-w), 0 if off */
+static int touch_pattern = 0; /* how to walk it (-W), see touch_names */
+
+/*
+ * The payload patterns of -W: every word in order, one word per cache
+ * line in order, or one word per cache line in a scattered order that
+ * the prefetcher cannot follow
+ */
+enum {TOUCH_SEQ, TOUCH_LINE, TOUCH_RAND};
+static char *touch_names[] = {"seq", "line", "rand", NULL};
+static volatile unsigned touch_sink; /* keeps the reads from being dropped */
+
+/* The heap timeline (-F): a CSV row every timeline_ops requests */
+static int timeline_fd = -1;
+static int timeline_ops = TIMELINE_OPS;
+
+/* The latency percentiles reported, and the names of the request types */
+static double lat_pcts[NUM_PCTS] = {50, 90, 99, 99.9};
+static char *op_names[3] = {"malloc", "free", "realloc"};
+
+/* Machine readable results (-o) and the run to compare against (-b) */
+static FILE *results_fp = NULL;
+static int results_csv = 0;   /* CSV rather than JSON? */
+static int results_rows = 0;  /* rows written so far */
+static baseline_t *baseline = NULL;
+static int num_baseline = 0;
+static double regress_pct = REGRESS_PCT;
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+/* these functions manipulate range trees */
+static int range_compare(const void *a, const void *b);
+static int add_range(void **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(void **ranges, char *lo);
+static void clear_ranges(void **ranges);
+
+/* Hands the heap back to memlib before each replay */
+static void reset_heap(void);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
+static inline void start_ops(trace_t *trace, opcursor_t *cur);
+static inline traceop_t *next_op(opcursor_t *cur);
+
+/* These replay a trace as it is read, for traces too big to load (-S) */
+static void open_stream(char *path, opstream_t *s);
+static void close_stream(opstream_t *s);
+static void *stream_reader(void *arg);
+static int read_chunk(opstream_t *s, traceop_t *ops);
+static int get_varint(FILE *fp, unsigned *v);
+static traceop_t *stream_chunk(opstream_t *s, int *len);
+static void live_init(livemap_t *m);
+static inline live_t *live_find(livemap_t *m, unsigned id);
+static live_t *live_add(livemap_t *m, unsigned id, char *p, int size);
+static void live_remove(livemap_t *m, live_t *e);
+static void eval_stream(char *tracefile, int tracenum, int libc,
+			result_t *res);
+static int stream_valid(char *path, int tracenum, int libc, void **ranges,
+			stats_t *st);
+static double stream_speed(char *path, int libc);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -121,12 +344,43 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, void **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, void **ranges);
+static void sample_heap(FILE *fp, int tracenum, int opnum, int live);
 static void eval_mm_speed(void *ptr);
+static inline void touch_write(char *p, size_t size, int index);
+static inline void touch_read(char *p, size_t size);
+static double eval_mm_threads(trace_t *trace, int num_threads, int cross);
+static void eval_mm_latency(trace_t *trace, lathist_t *hists, lat_t ovhd);
+static void *replay_shard(void *arg);
+
+/* These evaluate whole traces, one after another or in workers (-j) */
+static void eval_traces(char **tracefiles, int n, int libc, stats_t *stats,
+			double *mt_secs, lathist_t *hists);
+static void eval_trace(char *tracefile, int tracenum, int libc, 
+		       result_t *res, lathist_t *hists);
+static void time_speed(fsecs_test_funct f, speed_t *params, stats_t *st);
+static void start_worker(worker_t *workers, int slot, char *tracefile,
+			 int tracenum, int libc, lathist_t *hists);
+static int read_full(int fd, void *buf, size_t len);
+static void write_full(int fd, const void *buf, size_t len);
 
 /* Various helper routines */
+static mm_policy_t *find_policy(char *name);
 static void printresults(int n, stats_t *stats);
+static void printlatency(lathist_t *hists, lat_t ovhd);
+static void printcounters(int n, stats_t *stats);
+static void printsamples(int n, stats_t *stats);
+static void printcompare(int n, int num, char **names, int libc,
+			 stats_t **stats);
+static void open_results(char *path);
+static void writeresults(char *policy, int libc, char **tracefiles, int n,
+			 stats_t *stats);
+static void close_results(void);
+static void open_timeline(char *path);
+static void read_baseline(char *path);
+static int compare_baseline(char *policy, char **tracefiles, int n,
+			    stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -137,15 +391,23 @@ static void app_error(char *msg);
  **************/
 int main(int argc, char **argv)
 {
-    int i;
+    int i, p;
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
-    trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    mm_policy_t *selected[NUM_POLICIES]; /* policies to evaluate (-p) */
+    int num_selected = 0;      /* the number of policies in that array */
+    stats_t *all_stats[NUM_POLICIES + 1]; /* libc and every policy... */
+    char *all_names[NUM_POLICIES + 1];    /* ... side by side */
+    int num_all = 0;
+    double mt_secs[MAXTHREADS + 1]; /* replay time by number of threads */
+    lathist_t *lat_hists = NULL; /* latencies of each request type */
+    char *results_path = NULL; /* where to write the results (-o) */
+    char *baseline_path = NULL;/* results to compare against (-b) */
+    char *timeline_path = NULL;/* where to write the heap timeline (-F) */
+    int regressions = 0;       /* traces that did worse than the baseline */
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
@@ -153,12 +415,12 @@ int main(int argc, char **argv)
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
-    int numcorrect;
+    int numcorrect, k;
     
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:p:T:j:o:b:r:w:W:F:k:s:u:cxLPShvVgal")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +446,101 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'p': /* Evaluate the named mm policy (or all of them) */
+            if (!strcmp(optarg, "all")) {
+                for (num_selected = 0; num_selected < NUM_POLICIES; num_selected++)
+                    selected[num_selected] = &policies[num_selected];
+            }
+            else if (num_selected < NUM_POLICIES) {
+                if ((selected[num_selected] = find_policy(optarg)) == NULL) {
+                    usage();
+                    exit(1);
+                }
+                num_selected++;
+            }
+            break;
+        case 'T': /* Also replay the traces on 1 to n threads at once */
+            num_threads = atoi(optarg);
+            if (num_threads < 1 || num_threads > MAXTHREADS) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'j': /* Evaluate n traces at once in worker processes */
+            num_jobs = atoi(optarg);
+            if (num_jobs < 1 || num_jobs > MAXJOBS) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'o': /* Write the results as JSON, or CSV for a .csv name */
+            results_path = optarg;
+            break;
+        case 'b': /* Compare against the results of an earlier -o run */
+            baseline_path = optarg;
+            break;
+        case 'r': /* Percent a trace may get worse by before it regresses */
+            regress_pct = atof(optarg);
+            break;
+        case 'w': /* Touch this percent of every payload in the replay */
+            touch = atof(optarg) / 100;
+            if (touch <= 0 || touch > 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'W': /* Pattern to touch payloads in */
+            for (k = 0; touch_names[k] != NULL; k++)
+                if (!strcmp(optarg, touch_names[k]))
+                    break;
+            if (touch_names[k] == NULL) {
+                usage();
+                exit(1);
+            }
+            touch_pattern = k;
+            if (touch == 0)
+                touch = 1;
+            break;
+        case 'F': /* Write a timeline of the heap as CSV */
+            timeline_path = optarg;
+            break;
+        case 'k': /* Requests between the rows of the timeline */
+            timeline_ops = atoi(optarg);
+            if (timeline_ops < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 's': /* Time every trace n times and keep every sample */
+            if (atoi(optarg) < 2) {
+                usage();
+                exit(1);
+            }
+            sampling = 1;
+            set_fsecs_samples(atoi(optarg));
+            break;
+        case 'u': /* Untimed runs before the samples of -s */
+            if (atoi(optarg) < 0) {
+                usage();
+                exit(1);
+            }
+            set_fsecs_warmup(atoi(optarg));
+            break;
+        case 'S': /* Replay traces as they are read, in one pass */
+	    streaming = 1;
+	    break;
+        case 'c': /* Pin the workers to CPUs of their own */
+            pin = 1;
+            break;
+        case 'x': /* In the threaded replay, free from another thread */
+            cross = 1;
+            break;
+        case 'P': /* Count cycles, instructions and misses per trace */
+            counters = 1;
+            break;
+        case 'L': /* Print latency percentiles of single requests */
+            latency = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -243,8 +600,30 @@ int main(int argc, char **argv)
 	printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* A streamed trace is replayed once, and only for util and speed */
+    if (streaming && (num_threads > 0 || latency || counters || sampling ||
+		      timeline_path != NULL)) {
+	fprintf(stderr, "mdriver: -S cannot be combined with -T, -L, -P, "
+		"-s or -F\n");
+	exit(1);
+    }
+
     /* Initialize the timing package */
     init_fsecs();
+    if (counters && perfctr_init() == 0) {
+	printf("No hardware counters, %s. Timing with the clock only.\n",
+	       perfctr_error());
+	counters = 0;
+    }
+    if (touch > 0)
+	printf("Touching %g%% of each payload (%s)\n", touch * 100, 
+	       touch_names[touch_pattern]);
+    if (results_path != NULL)
+	open_results(results_path);
+    if (timeline_path != NULL)
+	open_timeline(timeline_path);
+    if (baseline_path != NULL)
+	read_baseline(baseline_path);
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -259,138 +638,501 @@ int main(int argc, char **argv)
 	    unix_error("libc_stats calloc in main failed");
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
-	for (i=0; i < num_tracefiles; i++) {
-	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
-	    if (verbose > 1)
-		printf("Checking libc malloc for correctness, ");
-	    libc_stats[i].valid = eval_libc_valid(trace, i);
-	    if (libc_stats[i].valid) {
-		speed_params.trace = trace;
-		if (verbose > 1)
-		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-	    }
-	    free_trace(trace);
-	}
+	eval_traces(tracefiles, num_tracefiles, 1, libc_stats, NULL, NULL);
 
 	/* Display the libc results in a compact table */
 	if (verbose) {
 	    printf("\nResults for libc malloc:\n");
 	    printresults(num_tracefiles, libc_stats);
 	}
+	if (sampling) {
+	    printf("\nTiming samples (libc malloc):\n");
+	    printsamples(num_tracefiles, libc_stats);
+	}
+	writeresults("libc", 1, tracefiles, num_tracefiles, libc_stats);
+	regressions += compare_baseline("libc", tracefiles, num_tracefiles,
+					libc_stats);
+	all_names[num_all] = "libc";
+	all_stats[num_all++] = libc_stats;
     }
 
-    /*
-     * Always run and evaluate the student's mm package
-     */
-    if (verbose > 1)
-	printf("\nTesting mm malloc\n");
+    /* Without -p only the default policy is evaluated */
+    if (num_selected == 0)
+	selected[num_selected++] = &policies[0];
 
-    /* Allocate the mm stats array, with one stats_t struct per tracefile */
-    mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
-	unix_error("mm_stats calloc in main failed");
-    
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+    /* One histogram per request type, indexed by traceop_t type */
+    if (latency) {
+	if ((lat_hists = (lathist_t *)malloc(3 * sizeof(lathist_t))) == NULL)
+	    unix_error("lat_hists malloc in main failed");
+	lat_ovhd = lat_overhead();
+    }
+
+    /*
+     * Always run and evaluate the student's mm package, once for
+     * every selected policy
+     */
+    for (p = 0; p < num_selected; p++) {
+	mm = selected[p];
+	errors = 0;  /* each policy is judged on its own failures */
 	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
+	    printf("\nTesting mm malloc (%s policy)\n", mm->name);
+
+	/* Allocate the mm stats array, with one stats_t struct per tracefile */
+	mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (mm_stats == NULL)
+	    unix_error("mm_stats calloc in main failed");
+	for (k = 0; k <= num_threads; k++)
+	    mt_secs[k] = 0;
+	if (latency)
+	    for (k = 0; k < 3; k++)
+		lat_reset(&lat_hists[k]);
+    
+	/* Evaluate student's mm malloc package using the K-best scheme */
+	eval_traces(tracefiles, num_tracefiles, 0, mm_stats, mt_secs, 
+		    lat_hists);
+	/* The next policy builds its own heap in the same memory */
+	mm->deinit();
+
+	/* Display the mm results in a compact table */
+	if (verbose) {
+	    printf("\nResults for mm malloc (%s policy):\n", mm->name);
+	    printresults(num_tracefiles, mm_stats);
+	    printf("\n");
+	}
+
+	/* 
+	 * Accumulate the aggregate statistics for the student's mm package 
+	 */
+	secs = 0;
+	ops = 0;
+	util = 0;
+	numcorrect = 0;
+	for (i=0; i < num_tracefiles; i++) {
+	    secs += mm_stats[i].secs;
+	    ops += mm_stats[i].ops;
+	    util += mm_stats[i].util;
+	    if (mm_stats[i].valid)
+		numcorrect++;
+	}
+	avg_mm_util = util/num_tracefiles;
+
+	/* 
+	 * Compute and print the performance index 
+	 */
+	if (num_selected > 1)
+	    printf("%s: ", mm->name);
+	if (errors == 0) {
+	    avg_mm_throughput = ops/secs;
+
+	    p1 = UTIL_WEIGHT * avg_mm_util;
+	    if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
+		p2 = (double)(1.0 - UTIL_WEIGHT);
+	    } 
+	    else {
+		p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
+		    (avg_mm_throughput/AVG_LIBC_THRUPUT);
+	    }
+	
+	    perfindex = (p1 + p2)*100.0;
+	    printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
+		   p1*100, 
+		   p2*100, 
+		   perfindex);
+	
+	}
+	else { /* There were errors */
+	    perfindex = 0.0;
+	    printf("Terminated with %d errors\n", errors);
+	}
+
+	if (sampling && errors == 0) {
+	    printf("\nTiming samples (%s policy):\n", mm->name);
+	    printsamples(num_tracefiles, mm_stats);
+	    printf("\n");
+	}
+
+	if (counters && errors == 0) {
+	    printf("\nHardware counters (%s policy):\n", mm->name);
+	    printcounters(num_tracefiles, mm_stats);
+	    printf("\n");
+	}
+
+	if (latency && errors == 0) {
+	    printf("\nLatency of single requests (%s policy):\n", mm->name);
+	    printlatency(lat_hists, lat_ovhd);
+	    printf("\n");
+	}
+
+	/* 
+	 * Print the throughput of the multi-threaded replays, and how 
+	 * close it comes to growing linearly with the threads
+	 */
+	if (num_threads > 0 && errors == 0) {
+	    if (!mm->threads)
+		printf("%s: not thread safe, no multi-threaded replay\n",
+		       mm->name);
+	    else {
+		printf("\nMulti-threaded replay (%s policy, %s frees):\n",
+		       mm->name, cross ? "cross-thread" : "same-thread");
+		printf("%7s %10s %8s\n", "threads", "Kops", "scaling");
+		for (k = 1; k <= num_threads; k++)
+		    printf("%7d %10.0f %8.2f\n", k, ops / mt_secs[k] / 1e3,
+			   mt_secs[1] / mt_secs[k] / k);
+		printf("\n");
+	    }
+	}
+
+	writeresults(mm->name, 0, tracefiles, num_tracefiles, mm_stats);
+	regressions += compare_baseline(mm->name, tracefiles, num_tracefiles,
+					mm_stats);
+	all_names[num_all] = mm->name;
+	all_stats[num_all++] = mm_stats;
+
+	/* The autograder summary is for the first policy only */
+	if (autograder && p == 0) {
+	    printf("correct:%d\n", numcorrect);
+	    printf("perfidx:%.0f\n", perfindex);
+	}
+    }
+
+    /* Put the allocators side by side when there is more than one */
+    if (num_all > 1)
+	printcompare(num_tracefiles, num_all, all_names, run_libc, all_stats);
+    for (p = 0; p < num_all; p++)
+	free(all_stats[p]);
+
+    close_results();
+    if (timeline_fd >= 0)
+	close(timeline_fd);
+    if (baseline_path != NULL) {
+	printf("%d regression%s against %s\n", regressions, 
+	       regressions == 1 ? "" : "s", baseline_path);
+	if (regressions > 0)
+	    exit(2);
+    }
+    exit(0);
+}
+
+/*****************************************************************
+ * The following routines evaluate whole traces. With -j each trace
+ * is evaluated in a worker process forked for it, up to num_jobs at
+ * once. A worker has its own copy of the simulated heap and of the
+ * allocator's state, and sends its result_t back over a pipe.
+ ****************************************************************/
+
+/*
+ * eval_traces - Evaluate the n traces with the policy in mm, or with
+ *     libc malloc, into stats. The multi-threaded replay times are
+ *     added to mt_secs and the latencies to hists, either of which
+ *     may be NULL for libc.
+ */
+static void eval_traces(char **tracefiles, int n, int libc, stats_t *stats,
+			double *mt_secs, lathist_t *hists)
+{
+    worker_t workers[MAXJOBS];
+    struct pollfd fds[MAXJOBS];
+    lathist_t *worker_hists = NULL;
+    result_t res;
+    int i, k, w, next = 0, running = 0;
+
+    if (num_jobs == 0) {
+	for (i = 0; i < n; i++) {
+	    eval_trace(tracefiles[i], i, libc, &res, hists);
+	    stats[i] = res.stats;
+	    if (mt_secs != NULL)
+		for (k = 1; k <= num_threads; k++)
+		    mt_secs[k] += res.mt_secs[k];
+	}
+	return;
+    }
+
+    if (hists != NULL && (worker_hists = malloc(3 * sizeof(lathist_t))) == NULL)
+	unix_error("malloc failed in eval_traces");
+    for (w = 0; w < num_jobs; w++)
+	workers[w].fd = -1;
+    while (next < n || running > 0) {
+	/* Keep every slot busy while there are traces left */
+	for (w = 0; w < num_jobs && next < n; w++)
+	    if (workers[w].fd < 0) {
+		start_worker(workers, w, tracefiles[next], next, libc, hists);
+		next++;
+		running++;
+	    }
+
+	for (w = 0; w < num_jobs; w++) {
+	    fds[w].fd = workers[w].fd;
+	    fds[w].events = POLLIN;
+	    fds[w].revents = 0;
+	}
+	if (poll(fds, num_jobs, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("poll failed in eval_traces");
+	}
+
+	/* Collect the results of the workers that are done */
+	for (w = 0; w < num_jobs; w++) {
+	    if (workers[w].fd < 0 || fds[w].revents == 0)
+		continue;
+	    i = workers[w].tracenum;
+	    if (read_full(workers[w].fd, &res, sizeof(res)) &&
+		(hists == NULL || 
+		 read_full(workers[w].fd, worker_hists, 3 * sizeof(lathist_t)))) {
+		stats[i] = res.stats;
+		errors += res.errors;
+		if (mt_secs != NULL)
+		    for (k = 1; k <= num_threads; k++)
+			mt_secs[k] += res.mt_secs[k];
+		if (hists != NULL)
+		    for (k = 0; k < 3; k++)
+			lat_merge(&hists[k], &worker_hists[k]);
+	    }
+	    else {
+		/* It died, e.g. in app_error, after saying why */
+		errors++;
+		printf("ERROR [trace %d]: worker exited without a result\n", i);
+		memset(&stats[i], 0, sizeof(stats_t));
+	    }
+	    close(workers[w].fd);
+	    waitpid(workers[w].pid, NULL, 0);
+	    workers[w].fd = -1;
+	    running--;
+	}
+    }
+    free(worker_hists);
+}
+
+/*
+ * eval_trace - Read one trace and evaluate it: correctness, then, if
+ *     it ran correctly, utilization, speed and whatever else the
+ *     command line asks for. Latencies are added to hists.
+ */
+static void eval_trace(char *tracefile, int tracenum, int libc, 
+		       result_t *res, lathist_t *hists)
+{
+    trace_t *trace;
+    void *ranges = NULL;   /* keeps track of block extents for the trace */
+    speed_t speed_params;  /* input parameters to the xx_speed routines */ 
+    static lathist_t trace_hists[3]; /* latencies of this trace alone */
+    int j, k, errors_before = errors;
+
+    if (streaming) {
+	eval_stream(tracefile, tracenum, libc, res);
+	return;
+    }
+
+    memset(res, 0, sizeof(result_t));
+    trace = read_trace(tracedir, tracefile);
+    res->stats.ops = trace->num_ops;
+    speed_params.trace = trace;
+
+    if (libc) {
+	if (verbose > 1)
+	    printf("Checking libc malloc for correctness, ");
+	res->stats.valid = eval_libc_valid(trace, tracenum);
+	if (res->stats.valid) {
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    time_speed(eval_libc_speed, &speed_params, &res->stats);
 	}
 	free_trace(trace);
+	res->errors = errors - errors_before;
+	return;
     }
 
-    /* Display the mm results in a compact table */
-    if (verbose) {
-	printf("\nResults for mm malloc:\n");
-	printresults(num_tracefiles, mm_stats);
-	printf("\n");
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    res->stats.valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (res->stats.valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	res->stats.util = eval_mm_util(trace, tracenum, &ranges);
+	speed_params.ranges = ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	time_speed(eval_mm_speed, &speed_params, &res->stats);
+	if (counters)
+	    fsecs_counters(eval_mm_speed, &speed_params, &res->stats.pc);
+
+	if (latency) {
+	    for (k = 0; k < 3; k++)
+		lat_reset(&trace_hists[k]);
+	    eval_mm_latency(trace, trace_hists, lat_ovhd);
+	    for (k = 0; k < 3; k++) {
+		res->stats.lat_n[k] = trace_hists[k].n;
+		for (j = 0; j < NUM_PCTS; j++)
+		    res->stats.lat[k][j] = lat_percentile(&trace_hists[k], 
+							  lat_pcts[j]);
+		lat_merge(&hists[k], &trace_hists[k]);
+	    }
+	}
+
+	/* Then replay it on 1 to num_threads threads at once */
+	if (mm->threads)
+	    for (k = 1; k <= num_threads; k++)
+		res->mt_secs[k] = eval_mm_threads(trace, k, cross);
     }
+    clear_ranges(&ranges);
+    free_trace(trace);
+    res->errors = errors - errors_before;
+}
 
-    /* 
-     * Accumulate the aggregate statistics for the student's mm package 
-     */
-    secs = 0;
-    ops = 0;
-    util = 0;
-    numcorrect = 0;
-    for (i=0; i < num_tracefiles; i++) {
-	secs += mm_stats[i].secs;
-	ops += mm_stats[i].ops;
-	util += mm_stats[i].util;
-	if (mm_stats[i].valid)
-	    numcorrect++;
-    }
-    avg_mm_util = util/num_tracefiles;
+/*
+ * time_speed - Time a replay of the trace with fsecs, or with -s with
+ *     fsecs_stats, whose mean and standard deviation go in secs and
+ *     secs_sd
+ */
+static void time_speed(fsecs_test_funct f, speed_t *params, stats_t *st)
+{
+    if (!sampling) {
+	st->secs = fsecs(f, params);
+	return;
+    }
+    fsecs_stats(f, params, &st->ts);
+    st->secs = st->ts.mean;
+    st->secs_sd = st->ts.sd;
+}
 
-    /* 
-     * Compute and print the performance index 
-     */
-    if (errors == 0) {
-	avg_mm_throughput = ops/secs;
+/*
+ * start_worker - Fork a worker into workers[slot] to evaluate one
+ *     trace. With -c the worker in slot k runs on the k-th CPU the
+ *     driver may use, so no two workers share a CPU unless there are
+ *     more slots than CPUs.
+ */
+static void start_worker(worker_t *workers, int slot, char *tracefile,
+			 int tracenum, int libc, lathist_t *hists)
+{
+    static cpu_set_t allowed;
+    static int num_allowed = -1;
+    cpu_set_t set;
+    result_t res;
+    int fds[2], cpu, k, w;
+
+    if (num_allowed < 0) {
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+	    unix_error("sched_getaffinity failed in start_worker");
+	num_allowed = CPU_COUNT(&allowed);
+    }
 
-	p1 = UTIL_WEIGHT * avg_mm_util;
-	if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
-	    p2 = (double)(1.0 - UTIL_WEIGHT);
-	} 
-	else {
-	    p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
-		(avg_mm_throughput/AVG_LIBC_THRUPUT);
+    if (pipe(fds) < 0)
+	unix_error("pipe failed in start_worker");
+    fflush(stdout); /* or the worker prints what is buffered again */
+    if ((workers[slot].pid = fork()) < 0)
+	unix_error("fork failed in start_worker");
+
+    if (workers[slot].pid == 0) {
+	close(fds[0]);
+	for (w = 0; w < num_jobs; w++)
+	    if (workers[w].fd >= 0)
+		close(workers[w].fd);
+	if (pin) {
+	    for (cpu = 0, k = slot % num_allowed; ; cpu++)
+		if (CPU_ISSET(cpu, &allowed) && k-- == 0)
+		    break;
+	    CPU_ZERO(&set);
+	    CPU_SET(cpu, &set);
+	    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		unix_error("sched_setaffinity failed in start_worker");
 	}
-	
-	perfindex = (p1 + p2)*100.0;
-	printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
-	       p1*100, 
-	       p2*100, 
-	       perfindex);
-	
-    }
-    else { /* There were errors */
-	perfindex = 0.0;
-	printf("Terminated with %d errors\n", errors);
+	if (hists != NULL)
+	    for (k = 0; k < 3; k++)
+		lat_reset(&hists[k]);
+	if (counters && perfctr_reopen() == 0) {
+	    fprintf(stderr, "mdriver: worker cannot open its counters, %s\n",
+		    perfctr_error());
+	    _exit(1);
+	}
+
+	eval_trace(tracefile, tracenum, libc, &res, hists);
+	fflush(stdout);
+	write_full(fds[1], &res, sizeof(res));
+	if (hists != NULL)
+	    write_full(fds[1], hists, 3 * sizeof(lathist_t));
+	_exit(0);
     }
 
-    if (autograder) {
-	printf("correct:%d\n", numcorrect);
-	printf("perfidx:%.0f\n", perfindex);
+    close(fds[1]);
+    workers[slot].fd = fds[0];
+    workers[slot].tracenum = tracenum;
+}
+
+/*
+ * read_full - Read len bytes from fd. Returns 0 if it ends first.
+ */
+static int read_full(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = read(fd, buf, len)) < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return 0;
+	buf = (char *)buf + n;
+	len -= n;
     }
+    return 1;
+}
 
-    exit(0);
+static void write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = write(fd, buf, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("write failed in write_full");
+	}
+	buf = (const char *)buf + n;
+	len -= n;
+    }
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. It is a
+ * tsearch tree, balanced in glibc, so each check takes O(log n) time
+ * in the number of live blocks.
  ****************************************************************/
 
+/*
+ * range_compare - Order two ranges by address. Overlapping ranges
+ *     compare equal, so looking up a new payload finds any live payload
+ *     it overlaps, and looking up the one byte range at lo finds the
+ *     payload that starts there.
+ */
+static int range_compare(const void *a, const void *b)
+{
+    const range_t *ra = a;
+    const range_t *rb = b;
+
+    if (ra->hi < rb->lo)
+	return -1;
+    if (ra->lo > rb->hi)
+	return 1;
+    return 0;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(void **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
     range_t *p;
+    range_t key;
+    void *node;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -413,61 +1155,55 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    key.lo = lo;
+    key.hi = hi;
+    if ((node = tfind(&key, ranges, range_compare)) != NULL) {
+	p = *(range_t **)node;
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    if (tsearch(p, ranges, range_compare) == NULL)
+	unix_error("tsearch error in add_range");
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(void **ranges, char *lo)
 {
+    range_t key;
     range_t *p;
-    range_t **prevpp = ranges;
-    //    int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-	    //            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    void *node;
+
+    key.lo = lo;
+    key.hi = lo;
+    if ((node = tfind(&key, ranges, range_compare)) != NULL) {
+	p = *(range_t **)node;
+	if (p->lo == lo) {
+	    tdelete(&key, ranges, range_compare);
+	    free(p);
+	}
     }
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
-static void clear_ranges(range_t **ranges)
+static void clear_ranges(void **ranges)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    tdestroy(*ranges, free);
     *ranges = NULL;
 }
 
@@ -477,17 +1213,20 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. A binary
+ *     trace (see tracebin.h) is mapped instead, and its requests are
+ *     decoded as they are replayed.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
-    FILE *tracefile;
+    FILE *tracefile = NULL;
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
     unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    int binary;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -499,19 +1238,30 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* Read the trace file header */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
+    if ((binary = tb_map(path, &trace->bin)) > 0) {
+	trace->sugg_heapsize = trace->bin.hdr->sugg_heapsize;
+	trace->num_ids = trace->bin.hdr->num_ids;
+	trace->num_ops = trace->bin.hdr->num_ops;
+	trace->weight = trace->bin.hdr->weight;
+	trace->ops = NULL;
+    }
+    else if (binary == 0)
+	tracefile = fopen(path, "r");
+    if (binary < 0 || (binary == 0 && tracefile == NULL)) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    if (!binary) {
+	fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+	fscanf(tracefile, "%d", &(trace->num_ids));     
+	fscanf(tracefile, "%d", &(trace->num_ops));     
+	fscanf(tracefile, "%d", &(trace->weight));        /* not used */
     
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
+	/* We'll store each request line in the trace in this array */
+	if ((trace->ops = 
+	     (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc 2 failed in read_trace");
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -522,6 +1272,10 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace->block_sizes = 
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
+
+    /* rep2bin checked the requests of a binary trace when it wrote them */
+    if (binary)
+	return trace;
     
     /* read every request line in the trace file */
     index = 0;
@@ -568,55 +1322,605 @@ static trace_t *read_trace(char *tracedir, char *filename)
  */
 void free_trace(trace_t *trace)
 {
+    if (trace->ops == NULL)
+	tb_unmap(&trace->bin);
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
-/**********************************************************************
- * The following functions evaluate the correctness, space utilization,
- * and throughput of the libc and mm malloc packages.
- **********************************************************************/
+/*
+ * start_ops - Point cur at the first request of trace
+ */
+static inline void start_ops(trace_t *trace, opcursor_t *cur)
+{
+    cur->ops = trace->ops;
+    cur->p = trace->bin.ops;
+    cur->end = trace->bin.end;
+    cur->num_ids = trace->num_ids;
+}
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * next_op - Return the next request of the trace cur walks. The
+ *     caller stops after trace->num_ops requests. A request decoded
+ *     from a binary trace is only valid until the next call.
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static inline traceop_t *next_op(opcursor_t *cur)
 {
-    int i, j;
-    int index;
-    int size;
-    int oldsize;
-    char *newp;
-    char *oldp;
-    char *p;
-    
-    /* Reset the heap and free any records in the range list */
-    mem_reset_brk();
-    clear_ranges(ranges);
+    unsigned index, size;
+    int type;
+
+    if (cur->ops != NULL)
+	return cur->ops++;
+
+    if (cur->p >= cur->end)
+	app_error("Binary trace ends before its last request");
+    if ((cur->p = tb_get_op(cur->p, cur->end, &type, &index, &size)) == NULL)
+	app_error("Binary trace has a request that is cut short or too big");
+    if (index >= (unsigned)cur->num_ids || type > TB_REALLOC || 
+	size > INT_MAX)
+	app_error("Bogus request in binary trace");
+    cur->op.type = type;
+    cur->op.index = index;
+    cur->op.size = size;
+    return &cur->op;
+}
 
-    /* Call the mm package's init function */
-    if (mm_init() < 0) {
-	malloc_error(tracenum, 0, "mm_init failed.");
-	return 0;
+/*****************************************************************
+ * The following routines replay a trace while it is read (-S), for
+ * traces with more requests than fit in memory
+ ****************************************************************/
+
+/*
+ * open_stream - Open the trace at path and start a thread reading its
+ *     requests. The counts in the header are not needed: the requests
+ *     are read until the end of the file.
+ */
+static void open_stream(char *path, opstream_t *s)
+{
+    tb_header_t hdr;
+    int k, n[4];
+
+    if (verbose > 1)
+	printf("Streaming tracefile: %s\n", path);
+    if ((s->fp = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in open_stream", path);
+	unix_error(msg);
+    }
+    s->binary = fread(&hdr, sizeof(hdr), 1, s->fp) == 1 &&
+	hdr.magic == TB_MAGIC && hdr.version == TB_VERSION;
+    if (!s->binary) {
+	rewind(s->fp);
+	if (fscanf(s->fp, "%d %d %d %d", &n[0], &n[1], &n[2], &n[3]) != 4) {
+	    sprintf(msg, "%s is not a trace file", path);
+	    app_error(msg);
+	}
     }
 
-    /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    for (k = 0; k < 2; k++) {
+	if ((s->buf[k] = (traceop_t *)malloc(STREAM_CHUNK * 
+					     sizeof(traceop_t))) == NULL)
+	    unix_error("malloc failed in open_stream");
+	s->full[k] = 0;
+    }
+    s->cur = -1;
+    s->stop = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->tid, NULL, stream_reader, s) != 0)
+	app_error("pthread_create failed in open_stream");
+}
+
+/*
+ * close_stream - Stop the reader, whether or not it got to the end,
+ *     and free what open_stream allocated
+ */
+static void close_stream(opstream_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->tid, NULL);
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s->buf[0]);
+    free(s->buf[1]);
+    fclose(s->fp);
+}
 
-        switch (trace->ops[i].type) {
+/*
+ * stream_reader - The reader thread. It fills the buffers in turn,
+ *     each once the replay is done with it, and ends after handing
+ *     over an empty one at the end of the trace.
+ */
+static void *stream_reader(void *arg)
+{
+    opstream_t *s = (opstream_t *)arg;
+    int k = 0, len;
+
+    for (;;) {
+	pthread_mutex_lock(&s->lock);
+	while (s->full[k] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+	if (s->stop)
+	    return NULL;
+
+	len = read_chunk(s, s->buf[k]);
+
+	pthread_mutex_lock(&s->lock);
+	s->len[k] = len;
+	s->full[k] = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	if (len == 0)
+	    return NULL;
+	k = !k;
+    }
+}
 
-        case ALLOC: /* mm_malloc */
+/*
+ * read_chunk - Read up to STREAM_CHUNK requests into ops, and return
+ *     how many there were
+ */
+static int read_chunk(opstream_t *s, traceop_t *ops)
+{
+    char type[MAXLINE];
+    unsigned v, index, size;
+    int n;
 
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
-		return 0;
+    for (n = 0; n < STREAM_CHUNK; n++) {
+	if (s->binary) {
+	    if (!get_varint(s->fp, &v))
+		break;
+	    ops[n].type = v & 3;
+	    ops[n].index = v >> 2;
+	    ops[n].size = 0;
+	    if (ops[n].type > TB_REALLOC ||
+		(ops[n].type != TB_FREE && !get_varint(s->fp, &v)))
+		app_error("Bogus request in binary trace");
+	    if (ops[n].type != TB_FREE) {
+		if (v > INT_MAX)
+		    app_error("Bogus request in binary trace");
+		ops[n].size = v;
 	    }
-	    
+	    continue;
+	}
+
+	if (fscanf(s->fp, "%s", type) == EOF)
+	    break;
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(s->fp, "%u %u", &index, &size) != 2)
+		app_error("Bogus request in trace file");
+	    ops[n].type = type[0] == 'a' ? ALLOC : REALLOC;
+	    ops[n].index = index;
+	    ops[n].size = size;
+	    break;
+	case 'f':
+	    if (fscanf(s->fp, "%u", &index) != 1)
+		app_error("Bogus request in trace file");
+	    ops[n].type = FREE;
+	    ops[n].index = index;
+	    break;
+	default:
+	    sprintf(msg, "Bogus type character (%c) in trace file", type[0]);
+	    app_error(msg);
+	}
+    }
+    return n;
+}
+
+/*
+ * get_varint - Read one varint of a binary trace (see tracebin.h).
+ *     Returns 0 at the end of the file, which may not cut one short,
+ *     and the varint must fit in 32 bits.
+ */
+static int get_varint(FILE *fp, unsigned *v)
+{
+    unsigned shift;
+    int c;
+
+    for (*v = 0, shift = 0; (c = getc_unlocked(fp)) != EOF; shift += 7) {
+	if (shift == 28 && (c & 0xf0))
+	    app_error("Binary trace has a request that is too big");
+	*v |= (unsigned)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return 1;
+    }
+    if (shift > 0)
+	app_error("Binary trace ends in the middle of a request");
+    return 0;
+}
+
+/*
+ * stream_chunk - Hand the reader back the buffer replayed last, wait
+ *     for the next one, and return its requests. len is 0 at the end
+ *     of the trace.
+ */
+static traceop_t *stream_chunk(opstream_t *s, int *len)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->cur >= 0) {
+	s->full[s->cur] = 0;
+	s->cur = !s->cur;
+	pthread_cond_broadcast(&s->cond);
+    }
+    else
+	s->cur = 0;
+    while (!s->full[s->cur])
+	pthread_cond_wait(&s->cond, &s->lock);
+    *len = s->len[s->cur];
+    pthread_mutex_unlock(&s->lock);
+    return s->buf[s->cur];
+}
+
+/*
+ * live_init - Start with an empty table of live blocks
+ */
+static void live_init(livemap_t *m)
+{
+    m->size = 1024;
+    m->used = 0;
+    if ((m->slots = (live_t *)calloc(m->size, sizeof(live_t))) == NULL)
+	unix_error("calloc failed in live_init");
+}
+
+/* Ids are mostly handed out in order, so spread them over the table */
+#define LIVE_HASH(m, id) (((id) * 2654435761u) & ((m)->size - 1))
+
+/*
+ * live_find - The live block with this id, or NULL
+ */
+static inline live_t *live_find(livemap_t *m, unsigned id)
+{
+    unsigned i;
+
+    for (i = LIVE_HASH(m, id); m->slots[i].p != NULL; 
+	 i = (i + 1) & (m->size - 1))
+	if (m->slots[i].id == id)
+	    return &m->slots[i];
+    return NULL;
+}
+
+/*
+ * live_add - Add a live block, growing the table to keep it at most
+ *     half full, and return its slot
+ */
+static live_t *live_add(livemap_t *m, unsigned id, char *p, int size)
+{
+    live_t *old = m->slots;
+    unsigned old_size = m->size, i;
+
+    if (2 * (m->used + 1) > m->size) {
+	m->size *= 2;
+	m->used = 0;
+	if ((m->slots = (live_t *)calloc(m->size, sizeof(live_t))) == NULL)
+	    unix_error("calloc failed in live_add");
+	for (i = 0; i < old_size; i++)
+	    if (old[i].p != NULL)
+		live_add(m, old[i].id, old[i].p, old[i].size);
+	free(old);
+    }
+    for (i = LIVE_HASH(m, id); m->slots[i].p != NULL; 
+	 i = (i + 1) & (m->size - 1))
+	;
+    m->slots[i].p = p;
+    m->slots[i].id = id;
+    m->slots[i].size = size;
+    m->used++;
+    return &m->slots[i];
+}
+
+/*
+ * live_remove - Remove the block in slot e, moving back the blocks
+ *     after it that could not go where they hashed to, so that no
+ *     tombstones are needed
+ */
+static void live_remove(livemap_t *m, live_t *e)
+{
+    unsigned i = e - m->slots, j, home;
+
+    m->slots[i].p = NULL;
+    m->used--;
+    for (j = (i + 1) & (m->size - 1); m->slots[j].p != NULL;
+	 j = (j + 1) & (m->size - 1)) {
+	home = LIVE_HASH(m, m->slots[j].id);
+	/* Leave it if its home is cyclically in (i, j] */
+	if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+	    continue;
+	m->slots[i] = m->slots[j];
+	m->slots[j].p = NULL;
+	i = j;
+    }
+}
+
+/*
+ * eval_stream - Evaluate one trace while it is read: correctness and
+ *     utilization in one pass, then speed in a second. Only the live
+ *     blocks and two chunks of requests are held in memory at a time.
+ */
+static void eval_stream(char *tracefile, int tracenum, int libc,
+			result_t *res)
+{
+    void *ranges = NULL;
+    char path[MAXLINE];
+    int errors_before = errors;
+
+    memset(res, 0, sizeof(result_t));
+    strcpy(path, tracedir);
+    strcat(path, tracefile);
+
+    if (verbose > 1)
+	printf("Checking %s for correctness, ", libc ? "libc malloc" :
+	       "mm_malloc");
+    res->stats.valid = stream_valid(path, tracenum, libc, &ranges, 
+				    &res->stats);
+    clear_ranges(&ranges);
+    if (res->stats.valid) {
+	if (verbose > 1)
+	    printf("and performance.\n");
+	res->stats.secs = stream_speed(path, libc);
+    }
+    res->errors = errors - errors_before;
+}
+
+/*
+ * stream_valid - Check the allocator on a streamed trace, as
+ *     eval_mm_valid does, and find its utilization and number of
+ *     requests on the way. libc malloc is only checked for failures.
+ */
+static int stream_valid(char *path, int tracenum, int libc, void **ranges,
+			stats_t *st)
+{
+    opstream_t s;
+    livemap_t live;
+    live_t *e;
+    traceop_t *op;
+    char *p;
+    int i, j, len, oldsize, opnum = 0, valid = 1;
+    long long total_size = 0, max_total_size = 0;
+
+    if (!libc) {
+	reset_heap();
+	if (mm->init() < 0) {
+	    malloc_error(tracenum, 0, "mm_init failed.");
+	    return 0;
+	}
+    }
+    live_init(&live);
+    open_stream(path, &s);
+
+    while (valid && (op = stream_chunk(&s, &len), len > 0)) {
+	for (i = 0; valid && i < len; i++, op++, opnum++) {
+	    e = live_find(&live, op->index);
+	    if ((op->type == ALLOC) != (e == NULL)) {
+		sprintf(msg, "Request %d on block id %d, which is %s", opnum,
+			op->index, e == NULL ? "not allocated" : 
+			"already allocated");
+		app_error(msg);
+	    }
+
+	    switch (op->type) {
+
+	    case ALLOC:
+		p = libc ? malloc(op->size) : mm->malloc(op->size);
+		if (p == NULL) {
+		    malloc_error(tracenum, opnum, "malloc failed.");
+		    valid = 0;
+		    break;
+		}
+		if (!libc) {
+		    if (add_range(ranges, p, op->size, tracenum, opnum) == 0) {
+			valid = 0;
+			break;
+		    }
+		    memset(p, op->index & 0xFF, op->size);
+		}
+		live_add(&live, op->index, p, op->size);
+		total_size += op->size;
+		break;
+
+	    case REALLOC:
+		p = libc ? realloc(e->p, op->size) : 
+		    mm->realloc(e->p, op->size);
+		if (p == NULL) {
+		    malloc_error(tracenum, opnum, "realloc failed.");
+		    valid = 0;
+		    break;
+		}
+		if (!libc) {
+		    remove_range(ranges, e->p);
+		    if (add_range(ranges, p, op->size, tracenum, opnum) == 0) {
+			valid = 0;
+			break;
+		    }
+		    oldsize = e->size < op->size ? e->size : op->size;
+		    for (j = 0; j < oldsize; j++)
+			if ((unsigned char)p[j] != (op->index & 0xFF))
+			    break;
+		    if (j < oldsize) {
+			malloc_error(tracenum, opnum, "mm_realloc did not "
+				     "preserve the data from old block");
+			valid = 0;
+			break;
+		    }
+		    memset(p, op->index & 0xFF, op->size);
+		}
+		total_size += op->size - e->size;
+		e->p = p;
+		e->size = op->size;
+		break;
+
+	    case FREE:
+		if (libc)
+		    free(e->p);
+		else {
+		    remove_range(ranges, e->p);
+		    mm->free(e->p);
+		}
+		total_size -= e->size;
+		live_remove(&live, e);
+		break;
+
+	    default:
+		app_error("Nonexistent request type in stream_valid");
+	    }
+	    if (total_size > max_total_size)
+		max_total_size = total_size;
+	}
+    }
+    close_stream(&s);
+
+    /* libc blocks the trace never freed would be lost otherwise */
+    if (libc)
+	for (i = 0; i < live.size; i++)
+	    if (live.slots[i].p != NULL)
+		free(live.slots[i].p);
+    free(live.slots);
+
+    st->ops = opnum;
+    if (!libc)
+	st->util = (double)max_total_size / (double)mem_heapsize();
+    return valid;
+}
+
+/*
+ * stream_speed - Replay a streamed trace once and return how long the
+ *     allocator took. Only the replay of each chunk is timed, not the
+ *     waits for the reader.
+ */
+static double stream_speed(char *path, int libc)
+{
+    opstream_t s;
+    livemap_t live;
+    live_t *e;
+    traceop_t *op;
+    char *p;
+    int i, len;
+    lat_t start, ns = 0;
+
+    live_init(&live);
+    open_stream(path, &s);
+
+    start = lat_now();
+    if (!libc) {
+	reset_heap();
+	if (mm->init() < 0)
+	    app_error("mm_init failed in stream_speed");
+    }
+    ns += lat_now() - start;
+
+    while ((op = stream_chunk(&s, &len), len > 0)) {
+	start = lat_now();
+	for (i = 0; i < len; i++, op++) {
+	    switch (op->type) {
+
+	    case ALLOC:
+		if ((p = libc ? malloc(op->size) : mm->malloc(op->size)) == NULL)
+		    app_error("malloc failed in stream_speed");
+		if (touch > 0)
+		    touch_write(p, op->size, op->index);
+		live_add(&live, op->index, p, op->size);
+		break;
+
+	    case REALLOC:
+		e = live_find(&live, op->index);
+		if ((p = libc ? realloc(e->p, op->size) :
+		     mm->realloc(e->p, op->size)) == NULL)
+		    app_error("realloc failed in stream_speed");
+		if (touch > 0)
+		    touch_write(p, op->size, op->index);
+		e->p = p;
+		e->size = op->size;
+		break;
+
+	    case FREE:
+		e = live_find(&live, op->index);
+		if (touch > 0)
+		    touch_read(e->p, e->size);
+		if (libc)
+		    free(e->p);
+		else
+		    mm->free(e->p);
+		live_remove(&live, e);
+		break;
+	    }
+	}
+	ns += lat_now() - start;
+    }
+    close_stream(&s);
+
+    if (libc)
+	for (i = 0; i < live.size; i++)
+	    if (live.slots[i].p != NULL)
+		free(live.slots[i].p);
+    free(live.slots);
+    return ns / 1e9;
+}
+
+/**********************************************************************
+ * The following functions evaluate the correctness, space utilization,
+ * and throughput of the libc and mm malloc packages.
+ **********************************************************************/
+
+/*
+ * reset_heap - Reset the brk for the next replay. The policy lets go of
+ *     the heap first: one with a helper thread (bg) may be touching it,
+ *     and only mm->deinit takes the heap lock to stop it.
+ */
+static void reset_heap(void)
+{
+    mm->deinit();
+    mem_reset_brk();
+}
+
+/*
+ * eval_mm_valid - Check the mm malloc package for correctness
+ */
+static int eval_mm_valid(trace_t *trace, int tracenum, void **ranges) 
+{
+    opcursor_t cur;
+    traceop_t *op;
+    int i, j;
+    int index;
+    int size;
+    int oldsize;
+    char *newp;
+    char *oldp;
+    char *p;
+    
+    /* Reset the heap and free any records in the range list */
+    reset_heap();
+    clear_ranges(ranges);
+
+    /* Call the mm package's init function */
+    if (mm->init() < 0) {
+	malloc_error(tracenum, 0, "mm_init failed.");
+	return 0;
+    }
+
+    /* Interpret each operation in the trace in order */
+    start_ops(trace, &cur);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+	index = op->index;
+	size = op->size;
+
+        switch (op->type) {
+
+        case ALLOC: /* mm_malloc */
+
+	    /* Call the student's malloc */
+	    if ((p = mm->malloc(size)) == NULL) {
+		malloc_error(tracenum, i, "mm_malloc failed.");
+		return 0;
+	    }
+	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
 	     * to the range list if OK. The block must be  be aligned properly,
@@ -641,7 +1945,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+	    if ((newp = mm->realloc(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
@@ -661,7 +1965,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -679,7 +1983,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    mm->free(p);
 	    break;
 
 	default:
@@ -703,7 +2007,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   is always the high water mark of the heap. 
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, void **ranges)
 {   
     int i;
     int index;
@@ -712,20 +2016,34 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int total_size = 0;
     char *p;
     char *newp, *oldp;
+    opcursor_t cur;
+    traceop_t *op;
+    FILE *tl = NULL;      /* the rows of the timeline for this trace... */
+    char *tl_buf = NULL;  /* ... as they are built up */
+    size_t tl_len;
 
     /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
-    if (mm_init() < 0)
+    reset_heap();
+    if (mm->init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
+    /* Workers (-j) share the timeline, so a trace writes it in one go */
+    if (timeline_fd >= 0 && mm->heapstats != NULL &&
+	(tl = open_memstream(&tl_buf, &tl_len)) == NULL)
+	unix_error("open_memstream failed in eval_mm_util");
+
+    start_ops(trace, &cur);
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+	if (tl != NULL && i % timeline_ops == 0)
+	    sample_heap(tl, tracenum, i, total_size);
+	op = next_op(&cur);
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = mm->malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -742,12 +2060,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    if ((newp = mm->realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
 	    /* Remember region and size */
@@ -764,11 +2082,11 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    mm->free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -782,9 +2100,95 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
+    if (tl != NULL) {
+	sample_heap(tl, tracenum, trace->num_ops, total_size);
+	fclose(tl);
+	write_full(timeline_fd, tl_buf, tl_len);
+	free(tl_buf);
+    }
+
     return ((double)max_total_size / (double)mem_heapsize());
 }
 
+/*
+ * sample_heap - Write one row of the timeline to fp: the heap after
+ *    opnum requests of the trace, while live bytes of payload are
+ *    allocated. External fragmentation is the part of the free bytes
+ *    that are not in the largest free block.
+ */
+static void sample_heap(FILE *fp, int tracenum, int opnum, int live)
+{
+    mm_heapstats_t hs;
+
+    mm->heapstats(&hs);
+    fprintf(fp, "%s,%d,%d,%d,%lu,%lu,%lu,%lu,%.4f\n", mm->name, tracenum,
+	    opnum, live, (unsigned long)hs.heap_bytes, 
+	    (unsigned long)hs.free_bytes, (unsigned long)hs.free_blocks,
+	    (unsigned long)hs.largest_free, hs.free_bytes == 0 ? 0 :
+	    1 - (double)hs.largest_free / hs.free_bytes);
+}
+
+
+/*
+ * touch_words - The number of words of a payload that -w covers, and 
+ *    in step how many words apart -W visits them
+ */
+static inline size_t touch_words(size_t size, size_t *step)
+{
+    size_t n = (size_t)(size * touch) / sizeof(unsigned);
+
+    *step = touch_pattern == TOUCH_SEQ ? 1 : TOUCH_STRIDE / sizeof(unsigned);
+    if (n == 0 && size >= sizeof(unsigned))
+	n = 1;
+    return n;
+}
+
+/*
+ * touch_next - The line to visit j-th in the rand pattern. A
+ *    prime stride visits every line once when there are fewer lines 
+ *    than the prime, and larger blocks are walked in order.
+ */
+static inline size_t touch_next(size_t j, size_t lines)
+{
+    return lines < TOUCH_PRIME ? (j * TOUCH_PRIME) % lines : j;
+}
+
+/*
+ * touch_write - Write the payload as an application filling in a new
+ *    block would, with -w and -W saying how much of it and in what order
+ */
+static inline void touch_write(char *p, size_t size, int index)
+{
+    unsigned *w = (unsigned *)p;
+    size_t i, j, step, n = touch_words(size, &step);
+    size_t lines = (n + step - 1) / step;
+
+    if (touch_pattern == TOUCH_RAND)
+	for (j = 0; j < lines; j++)
+	    w[touch_next(j, lines) * step] = index + j;
+    else
+	for (i = 0; i < n; i += step)
+	    w[i] = index + i;
+}
+
+/*
+ * touch_read - Read back what touch_write wrote, as an application 
+ *    does with a block before it frees it
+ */
+static inline void touch_read(char *p, size_t size)
+{
+    unsigned *w = (unsigned *)p, sum = 0;
+    size_t i, j, step, n = touch_words(size, &step);
+    size_t lines = (n + step - 1) / step;
+
+    if (touch_pattern == TOUCH_RAND)
+	for (j = 0; j < lines; j++)
+	    sum += w[touch_next(j, lines) * step];
+    else
+	for (i = 0; i < n; i += step)
+	    sum += w[i];
+    touch_sink += sum;
+}
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
@@ -792,45 +2196,252 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
+    opcursor_t cur;
+    traceop_t *op;
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0) 
+    reset_heap();
+    if (mm->init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    start_ops(trace, &cur);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            index = op->index;
+            size = op->size;
+            if ((p = mm->malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+	    if (touch > 0) {
+		touch_write(p, size, index);
+		trace->block_sizes[index] = size;
+	    }
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	    index = op->index;
+            newsize = op->size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
+            if ((newp = mm->realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
             trace->blocks[index] = newp;
+	    if (touch > 0) {
+		touch_write(newp, newsize, index);
+		trace->block_sizes[index] = newsize;
+	    }
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             block = trace->blocks[index];
-            mm_free(block);
+	    if (touch > 0)
+		touch_read(block, trace->block_sizes[index]);
+            mm->free(block);
             break;
 
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+    }
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, timing every request 
+ *    on its own, and add the latencies less the timer overhead ovhd 
+ *    to hists[type]
+ */
+static void eval_mm_latency(trace_t *trace, lathist_t *hists, lat_t ovhd)
+{
+    opcursor_t cur;
+    traceop_t *op;
+    int i, index;
+    char *p;
+    lat_t start, ns;
+
+    reset_heap();
+    if (mm->init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    start_ops(trace, &cur);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+	index = op->index;
+	switch (op->type) {
+
+	case ALLOC: /* mm_malloc */
+	    start = lat_now();
+	    p = mm->malloc(op->size);
+	    ns = lat_now() - start;
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    start = lat_now();
+	    p = mm->realloc(trace->blocks[index], op->size);
+	    ns = lat_now() - start;
+	    if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    start = lat_now();
+	    mm->free(trace->blocks[index]);
+	    ns = lat_now() - start;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	}
+	lat_record(&hists[op->type], ns > ovhd ? ns - ovhd : 0);
+    }
+}
+
+/*
+ * eval_mm_threads - Replay trace on num_threads threads at once against
+ *    the heap of a thread safe policy and return the best wall clock time
+ *    of MT_RUNS replays. The blocks are split among the threads by id.
+ *    A block is allocated and reallocated by the thread that owns its id,
+ *    and with cross set freed by the next thread, which first waits for
+ *    the owner to get that far in the trace.
+ */
+static double eval_mm_threads(trace_t *trace, int num_threads, int cross)
+{
+    mtreplay_t mt;
+    opcursor_t cur;
+    traceop_t *op, shard_op;
+    int *count, *seen;
+    int i, r, t;
+    double start, secs, best = 0;
+    struct timespec ts;
+
+    mt.trace = trace;
+    mt.num_threads = num_threads;
+    count = (int *)calloc(num_threads, sizeof(int));
+    seen = (int *)calloc(trace->num_ids, sizeof(int));
+    mt.done = (volatile int *)calloc(trace->num_ids, sizeof(int));
+    if (count == NULL || seen == NULL || mt.done == NULL)
+	unix_error("calloc failed in eval_mm_threads");
+
+    /* Count the requests of each shard, then deal them out */
+    start_ops(trace, &cur);
+    for (i = 0; i < trace->num_ops; i++) {
+	op = next_op(&cur);
+	t = op->index % num_threads;
+	if (op->type == FREE && cross)
+	    t = (t + 1) % num_threads;
+	count[t]++;
+    }
+    for (t = 0; t < num_threads; t++) {
+	mt.shards[t].mt = &mt;
+	mt.shards[t].num_ops = 0;
+	mt.shards[t].ops = (traceop_t *)malloc(count[t] * sizeof(traceop_t));
+	if (mt.shards[t].ops == NULL)
+	    unix_error("malloc failed in eval_mm_threads");
+    }
+    start_ops(trace, &cur);
+    for (i = 0; i < trace->num_ops; i++) {
+	op = next_op(&cur);
+	shard_op = *op;
+	t = op->index % num_threads;
+	if (op->type == FREE) {
+	    if (cross)
+		t = (t + 1) % num_threads;
+	    shard_op.size = seen[op->index];
+	}
+	else
+	    seen[op->index]++;
+	mt.shards[t].ops[mt.shards[t].num_ops++] = shard_op;
+    }
+
+    for (r = 0; r < MT_RUNS; r++) {
+	reset_heap();
+	if (mm->init() < 0) 
+	    app_error("mm_init failed in eval_mm_threads");
+	for (i = 0; i < trace->num_ids; i++)
+	    mt.done[i] = 0;
+
+	pthread_barrier_init(&mt.start, NULL, num_threads + 1);
+	for (t = 0; t < num_threads; t++)
+	    if (pthread_create(&mt.shards[t].tid, NULL, replay_shard, 
+			       &mt.shards[t]) != 0)
+		unix_error("pthread_create failed in eval_mm_threads");
+	pthread_barrier_wait(&mt.start);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec + ts.tv_nsec / 1e9;
+	for (t = 0; t < num_threads; t++)
+	    pthread_join(mt.shards[t].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	secs = ts.tv_sec + ts.tv_nsec / 1e9 - start;
+	pthread_barrier_destroy(&mt.start);
+	if (best == 0 || secs < best)
+	    best = secs;
+    }
+
+    for (t = 0; t < num_threads; t++)
+	free(mt.shards[t].ops);
+    free(count);
+    free(seen);
+    free((void *)mt.done);
+    return best;
+}
+
+/*
+ * replay_shard - Body of a thread of eval_mm_threads. A block pointer 
+ *    is published before the count in done that a freeing thread waits 
+ *    on.
+ */
+static void *replay_shard(void *arg)
+{
+    shard_t *shard = (shard_t *)arg;
+    mtreplay_t *mt = shard->mt;
+    char **blocks = mt->trace->blocks;
+    traceop_t *op;
+    char *p;
+    int i;
+
+    pthread_barrier_wait(&mt->start);
+    for (i = 0; i < shard->num_ops; i++) {
+	op = &shard->ops[i];
+	switch (op->type) {
+
+	case ALLOC: /* mm_malloc */
+	    if ((p = mm->malloc(op->size)) == NULL)
+		app_error("mm_malloc error in eval_mm_threads");
+	    blocks[op->index] = p;
+	    __sync_synchronize();
+	    mt->done[op->index]++;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm->realloc(blocks[op->index], op->size)) == NULL)
+		app_error("mm_realloc error in eval_mm_threads");
+	    blocks[op->index] = p;
+	    __sync_synchronize();
+	    mt->done[op->index]++;
+	    break;
+
+	case FREE: /* mm_free, once the owner is done with the block */
+	    while (mt->done[op->index] < op->size)
+		sched_yield();
+	    __sync_synchronize();
+	    mm->free(blocks[op->index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_threads");
+	}
+    }
+    return NULL;
 }
 
 /*
@@ -841,32 +2452,36 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
+    opcursor_t cur;
+    traceop_t *op;
     int i, newsize;
     char *p, *newp, *oldp;
 
+    start_ops(trace, &cur);
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+	op = next_op(&cur);
+        switch (op->type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op->size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op->index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op->size;
+	    oldp = trace->blocks[op->index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op->index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op->index]);
 	    break;
 
 	default:
@@ -884,34 +2499,48 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
+    opcursor_t cur;
+    traceop_t *op;
     int i;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
+    start_ops(trace, &cur);
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+	op = next_op(&cur);
+        switch (op->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
+	    if (touch > 0) {
+		touch_write(p, size, index);
+		trace->block_sizes[index] = size;
+	    }
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldp = trace->blocks[index];
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
 	    
 	    trace->blocks[index] = newp;
+	    if (touch > 0) {
+		touch_write(newp, newsize, index);
+		trace->block_sizes[index] = newsize;
+	    }
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    block = trace->blocks[index];
+	    if (touch > 0)
+		touch_read(block, trace->block_sizes[index]);
 	    free(block);
 	    break;
 	}
@@ -980,6 +2609,528 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printcompare - prints the results of several allocators on the same
+ *     traces side by side: utilization, throughput and, with -L, the
+ *     99th percentile malloc latency. If libc is set the first column
+ *     is libc malloc, whose utilization is not measured.
+ */
+static void printcompare(int n, int num, char **names, int libc,
+			 stats_t **stats)
+{
+    int i, p, width = latency ? 21 : 13;
+    double secs, ops, util;
+    stats_t *st;
+
+    printf("\nSide by side (util, Kops%s):\n", 
+	   latency ? ", malloc p99 ns" : "");
+    printf("%5s", "");
+    for (p = 0; p < num; p++)
+	printf(" %*s", width, names[p]);
+    printf("\n%5s", "trace");
+    for (p = 0; p < num; p++) {
+	printf(" %5s%8s", "util", "Kops");
+	if (latency)
+	    printf("%8s", "p99");
+    }
+    printf("\n");
+
+    for (i = 0; i < n; i++) {
+	printf("%5d", i);
+	for (p = 0; p < num; p++) {
+	    st = &stats[p][i];
+	    if (!st->valid) {
+		printf(" %5s%8s", "-", "-");
+		if (latency)
+		    printf("%8s", "-");
+		continue;
+	    }
+	    if (libc && p == 0)
+		printf(" %5s", "-");
+	    else
+		printf(" %4.0f%%", st->util * 100.0);
+	    printf("%8.0f", (st->ops / 1e3) / st->secs);
+	    if (latency) {
+		if (st->lat_n[ALLOC] > 0)
+		    printf("%8llu", st->lat[ALLOC][2]); /* p99 */
+		else
+		    printf("%8s", "-");
+	    }
+	}
+	printf("\n");
+    }
+
+    /* Average utilization and overall throughput, valid traces only */
+    printf("%5s", "Total");
+    for (p = 0; p < num; p++) {
+	secs = ops = util = 0;
+	for (i = 0; i < n; i++) {
+	    if (!stats[p][i].valid)
+		continue;
+	    secs += stats[p][i].secs;
+	    ops += stats[p][i].ops;
+	    util += stats[p][i].util;
+	}
+	if (libc && p == 0)
+	    printf(" %5s", "-");
+	else
+	    printf(" %4.0f%%", (util / n) * 100.0);
+	if (secs > 0)
+	    printf("%8.0f", (ops / 1e3) / secs);
+	else
+	    printf("%8s", "-");
+	if (latency)
+	    printf("%8s", "");
+    }
+    printf("\n");
+}
+
+/*
+ * printlatency - prints latency percentiles in ns for each request type
+ */
+static void printlatency(lathist_t *hists, lat_t ovhd)
+{
+    int i, j;
+
+    printf("%-8s%10s%8s%8s%8s%8s%10s\n", "op", "count", 
+	   "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < 3; i++) {
+	if (hists[i].n == 0)
+	    continue;
+	printf("%-8s%10llu", op_names[i], hists[i].n);
+	for (j = 0; j < NUM_PCTS; j++)
+	    printf("%8llu", lat_percentile(&hists[i], lat_pcts[j]));
+	printf("%10llu\n", hists[i].max);
+    }
+    printf("(ns, %llu ns of timer overhead subtracted from each request)\n", 
+	   ovhd);
+}
+
+/*
+ * printsamples - prints the spread of the timing samples of each trace
+ *     (-s) in microseconds: mean and its 95% confidence interval,
+ *     median, standard deviation, outliers, the first cold cache run,
+ *     and the median of the other cold runs and how much slower it is
+ *     than the warm median
+ */
+static void printsamples(int n, stats_t *stats)
+{
+    fsecs_stats_t *ts;
+    int i;
+
+    printf("%5s%6s%11s%9s%11s%9s%6s%11s%11s%6s\n", "trace", "runs", 
+	   "mean us", "+-95%", "median", "sd", "out", "first us", "cold us", 
+	   "cold");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid) {
+	    printf("%5d%6s\n", i, "-");
+	    continue;
+	}
+	ts = &stats[i].ts;
+	printf("%5d%6d%11.1f%9.1f%11.1f%9.1f%6d%11.1f%11.1f%5.1fx\n", i, 
+	       ts->n, ts->mean * 1e6, ts->ci95 * 1e6, ts->median * 1e6, 
+	       ts->sd * 1e6, ts->outliers, ts->cold_first * 1e6, 
+	       ts->cold * 1e6, 
+	       ts->median > 0 ? ts->cold / ts->median : 0);
+    }
+}
+
+/*
+ * printcounters - prints cycles and IPC, and cache, TLB and branch 
+ *     misses per request, for each trace from its hardware counts
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    static char *names[] = {"cyc/op", "IPC", "L1d/op", "LLC/op", 
+			    "dTLB/op", "br/op"};
+    pcounts_t *pc;
+    int i, j;
+
+    printf("%5s", "trace");
+    for (j = 0; j < PC_NUM; j++)
+	printf("%9s", names[j]);
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	pc = &stats[i].pc;
+	printf("%5d", i);
+	for (j = 0; j < PC_NUM; j++) {
+	    if (!pc->valid[j] || (j == PC_INSTRUCTIONS && !pc->valid[PC_CYCLES]))
+		printf("%9s", "-");
+	    else if (j == PC_INSTRUCTIONS)
+		printf("%9.2f", pc->val[PC_CYCLES] > 0 ? 
+		       pc->val[j] / pc->val[PC_CYCLES] : 0);
+	    else
+		printf("%9.2f", pc->val[j] / stats[i].ops);
+	}
+	printf("\n");
+    }
+}
+
+/*
+ * The following routines write the results in a form other programs
+ * can read (-o), and compare them with the results of an earlier run
+ * (-b). A JSON results file holds one trace result per line, which is
+ * what lets read_baseline read it back with sscanf; it is not a JSON
+ * parser for anything else.
+ */
+
+/* Names of the hardware counts in the results, indexed by PC_* */
+static char *pc_names[PC_NUM] = {"cycles", "instructions", "l1d_misses",
+				 "llc_misses", "dtlb_misses", "branch_misses"};
+
+/*
+ * open_results - Start the results file, CSV if the name ends in .csv.
+ *     The columns depend on -L, -P and -s, so they have to be set by now.
+ */
+static void open_results(char *path)
+{
+    int len = strlen(path), i, j;
+
+    if ((results_fp = fopen(path, "w")) == NULL)
+	unix_error("Could not create the results file");
+    results_csv = len > 4 && !strcmp(path + len - 4, ".csv");
+    if (!results_csv) {
+	fprintf(results_fp, "{\"results\": [\n");
+	return;
+    }
+    fprintf(results_fp, "policy,trace,valid,util,ops,secs,secs_sd,kops");
+    if (latency)
+	for (i = 0; i < 3; i++)
+	    for (j = 0; j < NUM_PCTS; j++)
+		fprintf(results_fp, ",%s_p%g", op_names[i], lat_pcts[j]);
+    if (counters)
+	for (j = 0; j < PC_NUM; j++)
+	    fprintf(results_fp, ",%s", pc_names[j]);
+    if (sampling)
+	fprintf(results_fp, ",runs,secs_median,secs_ci95,outliers,"
+		"secs_cold_first,secs_cold");
+    fprintf(results_fp, "\n");
+}
+
+/*
+ * open_timeline - Create the timeline file of -F and write its header.
+ *    Rows are appended a trace at a time, so that workers that write
+ *    at once do not mix their rows.
+ */
+static void open_timeline(char *path)
+{
+    static char header[] = "policy,trace,op,live_bytes,heap_bytes,"
+	"free_bytes,free_blocks,largest_free,ext_frag\n";
+
+    if ((timeline_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			    0644)) < 0)
+	unix_error("Could not create the timeline file");
+    write_full(timeline_fd, header, sizeof(header) - 1);
+}
+
+/*
+ * put_string - Write s as a JSON or CSV string
+ */
+static void put_string(char *s)
+{
+    fputc('"', results_fp);
+    for (; *s; s++) {
+	if (*s == '"')
+	    fputc(results_csv ? '"' : '\\', results_fp);
+	else if (*s == '\\' && !results_csv)
+	    fputc('\\', results_fp);
+	fputc(*s, results_fp);
+    }
+    fputc('"', results_fp);
+}
+
+/*
+ * writeresults - Add a row for every trace to the results file, with
+ *     the latency percentiles and counts where they were measured.
+ *     Neither is measured for libc. Counts that could not be read and
+ *     percentiles of request types the trace has none of are null in
+ *     JSON; in CSV all of these are left empty.
+ */
+static void writeresults(char *policy, int libc, char **tracefiles, int n,
+			 stats_t *stats)
+{
+    char *sep = results_csv ? "," : ", ";
+    stats_t *st;
+    int i, j, k, empty;
+
+    if (results_fp == NULL)
+	return;
+    for (i = 0; i < n; i++) {
+	st = &stats[i];
+	empty = 0; /* CSV columns left empty */
+	if (!results_csv)
+	    fprintf(results_fp, "%s{\"policy\": ", results_rows ? ",\n" : "");
+	put_string(policy);
+	fprintf(results_fp, results_csv ? "," : ", \"trace\": ");
+	put_string(tracefiles[i]);
+	fprintf(results_fp, results_csv ? ",%d" : ", \"valid\": %d", st->valid);
+
+	if (!st->valid)
+	    empty += 5;
+	else {
+	    fprintf(results_fp, results_csv ? ",%.6f,%.0f,%.9f,%.9f," :
+		    ", \"util\": %.6f, \"ops\": %.0f, \"secs\": %.9f, "
+		    "\"secs_sd\": %.9f, \"kops\": ", 
+		    st->util, st->ops, st->secs, st->secs_sd);
+	    /* A trace too short for the clock has no rate, not inf */
+	    if (st->secs > 0)
+		fprintf(results_fp, "%.1f", st->ops / 1e3 / st->secs);
+	    else if (!results_csv)
+		fprintf(results_fp, "null");
+	}
+
+	if (latency && (!st->valid || libc))
+	    empty += 3 * NUM_PCTS;
+	else if (latency) {
+	    if (!results_csv)
+		fprintf(results_fp, ", \"lat_ns\": {");
+	    for (k = 0; k < 3; k++) {
+		if (!results_csv)
+		    fprintf(results_fp, "%s\"%s\": [", k ? ", " : "", 
+			    op_names[k]);
+		for (j = 0; j < NUM_PCTS; j++) {
+		    fprintf(results_fp, "%s", j || results_csv ? sep : "");
+		    if (st->lat_n[k] > 0)
+			fprintf(results_fp, "%llu", st->lat[k][j]);
+		    else if (!results_csv)
+			fprintf(results_fp, "null");
+		}
+		if (!results_csv)
+		    fprintf(results_fp, "]");
+	    }
+	    if (!results_csv)
+		fprintf(results_fp, "}");
+	}
+
+	if (counters && (!st->valid || libc))
+	    empty += PC_NUM;
+	else if (counters) {
+	    if (!results_csv)
+		fprintf(results_fp, ", \"counters\": {");
+	    for (j = 0; j < PC_NUM; j++) {
+		if (!results_csv)
+		    fprintf(results_fp, "%s\"%s\": ", j ? ", " : "", 
+			    pc_names[j]);
+		else
+		    fputc(',', results_fp);
+		if (st->pc.valid[j])
+		    fprintf(results_fp, "%.0f", st->pc.val[j]);
+		else if (!results_csv)
+		    fprintf(results_fp, "null");
+	    }
+	    if (!results_csv)
+		fprintf(results_fp, "}");
+	}
+
+	if (sampling && !st->valid)
+	    empty += 6;
+	else if (sampling)
+	    fprintf(results_fp, results_csv ? ",%d,%.9f,%.9f,%d,%.9f,%.9f" :
+		    ", \"runs\": %d, \"secs_median\": %.9f, "
+		    "\"secs_ci95\": %.9f, \"outliers\": %d, "
+		    "\"secs_cold_first\": %.9f, \"secs_cold\": %.9f", 
+		    st->ts.n, st->ts.median, st->ts.ci95, st->ts.outliers, 
+		    st->ts.cold_first, st->ts.cold);
+
+	if (results_csv) {
+	    while (empty-- > 0)
+		fputc(',', results_fp);
+	    fputc('\n', results_fp);
+	}
+	else
+	    fputc('}', results_fp);
+	results_rows++;
+    }
+    fflush(results_fp);
+}
+
+static void close_results(void)
+{
+    if (results_fp == NULL)
+	return;
+    if (!results_csv)
+	fprintf(results_fp, "\n]}\n");
+    if (fclose(results_fp) != 0)
+	unix_error("Could not write the results file");
+    results_fp = NULL;
+}
+
+/*
+ * get_field - Find "key": in a results line and return what follows it
+ */
+static char *get_field(char *line, char *key)
+{
+    char pattern[64];
+    char *p;
+
+    sprintf(pattern, "\"%s\": ", key);
+    if ((p = strstr(line, pattern)) == NULL)
+	return NULL;
+    return p + strlen(pattern);
+}
+
+/*
+ * get_string - Copy the JSON string at p into buf of size len
+ */
+static int get_string(char *p, char *buf, int len)
+{
+    int n = 0;
+
+    if (p == NULL || *p++ != '"')
+	return 0;
+    for (; *p && *p != '"'; p++) {
+	if (*p == '\\' && p[1] != '\0')
+	    p++;
+	if (n < len - 1)
+	    buf[n++] = *p;
+    }
+    buf[n] = '\0';
+    return *p == '"';
+}
+
+/*
+ * read_baseline - Load the trace results of a JSON results file
+ */
+static void read_baseline(char *path)
+{
+    FILE *fp;
+    char line[4 * MAXLINE];
+    baseline_t *b;
+    int max = 0;
+    char *p;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	unix_error("Could not open the baseline");
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (get_field(line, "policy") == NULL)
+	    continue;
+	if (num_baseline == max) {
+	    max = max ? 2 * max : 64;
+	    if ((baseline = realloc(baseline, max * sizeof(baseline_t))) == NULL)
+		unix_error("realloc failed in read_baseline");
+	}
+	b = &baseline[num_baseline];
+	memset(b, 0, sizeof(*b));
+	if (!get_string(get_field(line, "policy"), b->policy, 
+			sizeof(b->policy)) ||
+	    !get_string(get_field(line, "trace"), b->trace, sizeof(b->trace)) ||
+	    (p = get_field(line, "valid")) == NULL) {
+	    printf("%s: not a results file written by -o\n", path);
+	    exit(1);
+	}
+	b->valid = atoi(p);
+	if ((p = get_field(line, "util")) != NULL)
+	    b->util = atof(p);
+	if ((p = get_field(line, "secs")) != NULL)
+	    b->secs = atof(p);
+	if ((p = get_field(line, "secs_sd")) != NULL)
+	    b->secs_sd = atof(p);
+	if ((p = get_field(line, "runs")) != NULL)
+	    b->runs = atoi(p);
+	num_baseline++;
+    }
+    fclose(fp);
+    if (num_baseline == 0) {
+	printf("%s: no results in the baseline\n", path);
+	exit(1);
+    }
+}
+
+/*
+ * compare_baseline - Compare the traces of a policy with the baseline
+ *     run and print the ones that regressed (see REGRESS_PCT in
+ *     config.h), and with -v every trace. Returns the number of
+ *     regressions. A trace missing from the baseline is not compared.
+ */
+static int compare_baseline(char *policy, char **tracefiles, int n,
+			    stats_t *stats)
+{
+    baseline_t *b;
+    stats_t *st;
+    double var_b, var_s, df, dsecs, dutil;
+    int i, j, slower, worse, regressions = 0;
+    char *verdict;
+
+    if (baseline == NULL)
+	return 0;
+    printf("\nCompared with the baseline (%s policy):\n", policy);
+    printf("%5s %10s %10s %8s %8s  %s\n", "trace", "base secs", "secs",
+	   "time", "util", "");
+    for (i = 0; i < n; i++) {
+	st = &stats[i];
+	for (j = 0, b = NULL; j < num_baseline && b == NULL; j++)
+	    if (!strcmp(baseline[j].policy, policy) &&
+		!strcmp(baseline[j].trace, tracefiles[i]))
+		b = &baseline[j];
+	if (b == NULL) {
+	    if (verbose)
+		printf("%5d %10s %10s %8s %8s  not in baseline\n", i, "-", "-",
+		       "-", "-");
+	    continue;
+	}
+	if (!st->valid || !b->valid) {
+	    worse = b->valid && !st->valid;
+	    regressions += worse;
+	    if (worse || verbose)
+		printf("%5d %10s %10s %8s %8s  %s\n", i, "-", "-", "-", "-",
+		       worse ? "REGRESSED, not valid" : 
+		       st->valid ? "valid now" : "not valid in either");
+	    continue;
+	}
+
+	/* 
+	 * A slowdown counts if it is big and, when both runs took -s
+	 * samples, the means differ in Welch's t test at 95%
+	 */
+	dsecs = st->secs - b->secs;
+	slower = dsecs > regress_pct / 100 * b->secs;
+	if (slower && b->runs > 1 && st->ts.n > 1) {
+	    var_b = b->secs_sd * b->secs_sd / b->runs;
+	    var_s = st->secs_sd * st->secs_sd / st->ts.n;
+	    if (var_b + var_s > 0) {
+		df = (var_b + var_s) * (var_b + var_s) / 
+		    (var_b * var_b / (b->runs - 1) + 
+		     var_s * var_s / (st->ts.n - 1));
+		slower = dsecs > t_975((int)df) * sqrt(var_b + var_s);
+	    }
+	}
+	/* Utilization is the same on every run, so any drop is real */
+	dutil = st->util - b->util;
+	worse = -dutil > regress_pct / 100 * b->util;
+
+	if (slower && worse)
+	    verdict = "REGRESSED, slower and less space efficient";
+	else if (slower)
+	    verdict = "REGRESSED, slower";
+	else if (worse)
+	    verdict = "REGRESSED, less space efficient";
+	else
+	    verdict = "";
+	if (slower || worse || verbose)
+	    printf("%5d %10.6f %10.6f %+7.1f%% %+7.1f%%  %s\n", i, b->secs,
+		   st->secs, b->secs > 0 ? 100 * dsecs / b->secs : 0,
+		   100 * dutil, verdict);
+	regressions += slower || worse;
+    }
+    return regressions;
+}
+
+/*
+ * find_policy - Look up a policy instantiation of mm.c by name
+ */
+static mm_policy_t *find_policy(char *name)
+{
+    mm_policy_t *p;
+
+    for (p = policies; p->name != NULL; p++)
+	if (!strcmp(p->name, name))
+	    return p;
+    fprintf(stderr, "Unknown policy: %s\n", name);
+    return NULL;
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1012,14 +3163,51 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLPSxc] [-f <file>] [-t <dir>] [-p <policy>] [-T <n>]\n");
+    fprintf(stderr, "               [-j <n>] [-o <file>] [-b <file>] [-r <pct>]\n");
+    fprintf(stderr, "               [-w <pct>] [-W <pattern>] [-F <file>] [-k <n>]\n");
+    fprintf(stderr, "               [-s <n>] [-u <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-b <file>  Compare with the results of a -o run, exit 2 if\n");
+    fprintf(stderr, "\t           any trace regressed.\n");
+    fprintf(stderr, "\t-c         With -j, pin each worker to a CPU of its own.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file (.rep or rep2bin output).\n");
+    fprintf(stderr, "\t-F <file>  Write a CSV timeline of the heap and its free\n");
+    fprintf(stderr, "\t           blocks while each trace runs (see plotfrag.sh).\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate <n> traces at once in worker processes.\n");
+    fprintf(stderr, "\t-k <n>     With -F, a row every <n> requests (default %d).\n",
+	    TIMELINE_OPS);
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Time every request and print latency percentiles.\n");
+    fprintf(stderr, "\t-o <file>  Write the results as JSON, or CSV if <file> ends\n");
+    fprintf(stderr, "\t           in .csv.\n");
+    fprintf(stderr, "\t-P         Print IPC and misses per request from the hardware\n");
+    fprintf(stderr, "\t           counters, where perf_event_open has them.\n");
+    fprintf(stderr, "\t-p <name>  Evaluate mm policy <name> (first, seg, best, pf,\n");
+    fprintf(stderr, "\t           bg, adapt, segmt, ff for mm-firstfit.c, or all).\n");
+    fprintf(stderr, "\t           May be repeated, or combined with -l, to compare\n");
+    fprintf(stderr, "\t           allocators side by side.\n");
+    fprintf(stderr, "\t-r <pct>   With -b, how much worse than the baseline a trace\n");
+    fprintf(stderr, "\t           may get (default %g).\n", REGRESS_PCT);
+    fprintf(stderr, "\t-s <n>     Time each trace <n> times, after cold cache and\n");
+    fprintf(stderr, "\t           warmup runs, and print the spread of the times.\n");
+    fprintf(stderr, "\t-S         Replay each trace while it is read, in one timed\n");
+    fprintf(stderr, "\t           pass, for traces too big to load.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace on 1 to <n> threads at once,\n");
+    fprintf(stderr, "\t           split by block id (thread safe policies only).\n");
+    fprintf(stderr, "\t-u <n>     With -s, untimed warmup runs (default %d).\n",
+	    FSECS_WARMUP);
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-w <pct>   Write <pct> percent of each payload when it is\n");
+    fprintf(stderr, "\t           allocated and read it back when it is freed.\n");
+    fprintf(stderr, "\t-W <pat>   Touch payloads word by word (seq), one word per\n");
+    fprintf(stderr, "\t           cache line (line) or a line at a time out of\n");
+    fprintf(stderr, "\t           order (rand). Implies -w 100 if -w is not given.\n");
+    fprintf(stderr, "\t-x         With -T, free each block from another thread\n");
+    fprintf(stderr, "\t           than the one that allocated it.\n");
 }
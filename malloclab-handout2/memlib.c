@@ -10,6 +10,8 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -19,6 +21,56 @@ static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
 
+/*
+ * A heap in a file or a shared memory object starts one header after 
+ * the start of the mapping. The header records the brk, so the heap 
+ * comes back at its old size when the file is mapped again, and 
+ * processes sharing the heap see each other's mem_sbrk.
+ */
+#define MEM_MAGIC 0x6d656d46    /* "memF" */
+#define MEM_HDR_SIZE 64         /* keeps the heap cache line aligned */
+
+typedef struct {
+    unsigned magic;             /* MEM_MAGIC once the file is set up */
+    size_t size;                /* bytes available to the heap */
+    size_t brk;                 /* current size of the heap */
+} mem_hdr_t;
+
+static mem_hdr_t *mem_hdr;   /* header of a file backed heap, else NULL */
+static int mem_fd = -1;      /* the heap file */
+static int mem_is_shared;    /* other processes map the heap too */
+
+/* 
+ * mem_cur_brk - the brk, as another process may have moved it 
+ */
+static char *mem_cur_brk(void)
+{
+    if (mem_is_shared)
+	mem_brk = mem_start_brk + mem_hdr->brk;
+    return mem_brk;
+}
+
+/*
+ * mem_map - map the heap file mem_fd, which has room for size bytes of
+ *    heap after the header, near base. Returns -1 on error.
+ */
+static int mem_map(size_t size, void *base)
+{
+    char *map = mmap(base, size + MEM_HDR_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_SHARED, mem_fd, 0);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "mem_map: mmap failed: %s\n", strerror(errno));
+	close(mem_fd);
+	mem_fd = -1;
+	return -1;
+    }
+    mem_hdr = (mem_hdr_t *)map;
+    mem_start_brk = map + MEM_HDR_SIZE;
+    mem_max_addr = mem_start_brk + size;
+    return 0;
+}
+
 /* 
  * mem_init - initialize the memory system model
  */
@@ -34,11 +86,152 @@ void mem_init(void)
     mem_brk = mem_start_brk;                  /* heap is empty initially */
 }
 
+/*
+ * mem_init_file - initialize the memory system model with a heap that
+ *    lives in the file path, so it outlives the process. The file is
+ *    created or grown to hold size bytes of heap (MAX_HEAP if size is 0).
+ *    base is only a hint for where to map it. Returns 1 if the file 
+ *    already held a heap, which is then mapped back at its old size, 0
+ *    for a new empty heap and -1 on error.
+ */
+int mem_init_file(const char *path, size_t size, void *base)
+{
+    struct stat st;
+    int old;
+
+    if (size == 0)
+	size = MAX_HEAP;
+    if ((mem_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 || 
+	fstat(mem_fd, &st) < 0) {
+        fprintf(stderr, "mem_init_file: cannot open %s: %s\n", 
+		path, strerror(errno));
+	return -1;
+    }
+    old = st.st_size >= MEM_HDR_SIZE;
+    if (old && st.st_size - MEM_HDR_SIZE > size)
+	size = st.st_size - MEM_HDR_SIZE;
+    if (ftruncate(mem_fd, size + MEM_HDR_SIZE) < 0) {
+        fprintf(stderr, "mem_init_file: cannot grow %s: %s\n", 
+		path, strerror(errno));
+	close(mem_fd);
+	mem_fd = -1;
+	return -1;
+    }
+    if (mem_map(size, base) < 0)
+	return -1;
+
+    if (!old || mem_hdr->magic != MEM_MAGIC || mem_hdr->brk > size) {
+	mem_hdr->magic = MEM_MAGIC;
+	mem_hdr->brk = 0;
+	old = 0;
+    }
+    mem_hdr->size = size;
+    mem_brk = mem_start_brk + mem_hdr->brk;
+    return old && mem_hdr->brk > 0;
+}
+
+/*
+ * mem_init_shared - initialize the memory system model with a heap in 
+ *    the POSIX shared memory object name, which any number of processes
+ *    map with this call. The process that creates the object makes room
+ *    for size bytes of heap (MAX_HEAP if size is 0) and gets 0 back; it
+ *    builds the heap with mm_init. The others get 1 back and join with
+ *    mm_attach once the heap is built. Returns -1 on error. The object
+ *    stays around until it is removed with shm_unlink.
+ */
+int mem_init_shared(const char *name, size_t size)
+{
+    struct stat st;
+    int created = 1;
+
+    if (size == 0)
+	size = MAX_HEAP;
+    if ((mem_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 &&
+	errno == EEXIST) {
+	created = 0;
+	mem_fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (mem_fd < 0) {
+        fprintf(stderr, "mem_init_shared: cannot open %s: %s\n", 
+		name, strerror(errno));
+	return -1;
+    }
+
+    if (created) {
+	if (ftruncate(mem_fd, size + MEM_HDR_SIZE) < 0) {
+	    fprintf(stderr, "mem_init_shared: cannot size %s: %s\n", 
+		    name, strerror(errno));
+	    close(mem_fd);
+	    mem_fd = -1;
+	    return -1;
+	}
+    }
+    else {
+	/* Wait for the creator to size the object */
+	for (;;) {
+	    if (fstat(mem_fd, &st) < 0) {
+		fprintf(stderr, "mem_init_shared: cannot stat %s: %s\n", 
+			name, strerror(errno));
+		close(mem_fd);
+		mem_fd = -1;
+		return -1;
+	    }
+	    if (st.st_size > MEM_HDR_SIZE)
+		break;
+	    usleep(1000);
+	}
+	size = st.st_size - MEM_HDR_SIZE;
+    }
+    if (mem_map(size, NULL) < 0)
+	return -1;
+
+    if (created) {
+	mem_hdr->size = size;
+	mem_hdr->brk = 0;
+	__sync_synchronize();
+	mem_hdr->magic = MEM_MAGIC;
+    }
+    else {
+	while (((volatile mem_hdr_t *)mem_hdr)->magic != MEM_MAGIC)
+	    usleep(1000);
+    }
+    mem_is_shared = 1;
+    mem_brk = mem_start_brk + mem_hdr->brk;
+    return !created;
+}
+
+/*
+ * mem_shared - return true if other processes may use the heap too
+ */
+int mem_shared(void)
+{
+    return mem_is_shared;
+}
+
+/*
+ * mem_sync - write a file backed heap out to the file. Returns -1 on
+ *    error, 0 otherwise.
+ */
+int mem_sync(void)
+{
+    if (mem_hdr == NULL)
+	return 0;
+    return msync(mem_hdr, MEM_HDR_SIZE + mem_hdr->size, MS_SYNC);
+}
+
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void)
 {
+    if (mem_hdr != NULL) {
+	munmap(mem_hdr, MEM_HDR_SIZE + mem_hdr->size);
+	close(mem_fd);
+	mem_hdr = NULL;
+	mem_fd = -1;
+	mem_is_shared = 0;
+	return;
+    }
     free(mem_start_brk);
 }
 
@@ -48,6 +241,8 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    if (mem_hdr != NULL)
+	mem_hdr->brk = 0;
 }
 
 /* 
@@ -57,7 +252,7 @@ void mem_reset_brk()
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk = mem_cur_brk();
 
     if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
         errno = ENOMEM;
@@ -65,6 +260,8 @@ void *mem_sbrk(int incr)
         return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_hdr != NULL)
+	mem_hdr->brk = mem_brk - mem_start_brk;
     return (void *)old_brk;
 }
 
@@ -81,7 +278,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(mem_cur_brk() - 1);
 }
 
 /*
@@ -89,7 +286,29 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return (size_t)(mem_cur_brk() - mem_start_brk);
+}
+
+/*
+ * mem_release - tell the OS that the whole pages in [lo, lo+len) hold
+ *    nothing of value. They stay part of the heap and read back as
+ *    zeros the next time they are touched. Dropping the pages of a file
+ *    or shared heap would only unmap them, and they would read back
+ *    from the file, so there they are punched out of the file instead.
+ *    Where the file system cannot punch holes they are left alone.
+ */
+void mem_release(void *lo, size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    char *start = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *end = (char *)(((size_t)lo + len) & ~(pagesize - 1));
+
+    if (end <= start)
+	return;
+    if (mem_fd >= 0)
+	madvise(start, end - start, MADV_REMOVE);
+    else
+	madvise(start, end - start, MADV_DONTNEED);
 }
 
 /*
@@ -1,6 +1,10 @@
 #include <unistd.h>
 
 void mem_init(void);               
+int mem_init_file(const char *path, size_t size, void *base);
+int mem_init_shared(const char *name, size_t size);
+int mem_shared(void);
+int mem_sync(void);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
@@ -8,4 +12,5 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void mem_release(void *lo, size_t len);
 
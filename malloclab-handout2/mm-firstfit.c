@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include "mm-prefix.h"
 #include "mm.h"
 #include "memlib.h"
 
@@ -200,6 +201,35 @@ void mm_checkheap(int verbose)
         printf("Bad epilogue header\n");
 }
 
+/*
+ * mm_deinit - Forget the heap; mdriver resets memlib before the next mm_init
+ */
+void mm_deinit(void)
+{
+    heap_listp = NULL;
+}
+
+/*
+ * mm_heapstats - Add up the free blocks of the heap
+ */
+void mm_heapstats(mm_heapstats_t *hs)
+{
+    char *bp;
+    size_t size;
+
+    memset(hs, 0, sizeof(*hs));
+    if (heap_listp == NULL)
+        return;
+    hs->heap_bytes = mem_heapsize();
+    for (bp = heap_listp; (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+        if (GET_ALLOC(HDRP(bp)))
+            continue;
+        hs->free_bytes += size;
+        hs->free_blocks++;
+        hs->largest_free = MAX(hs->largest_free, size);
+    }
+}
+
 /* The remaining routines are internal helper routines */
 
 /* 
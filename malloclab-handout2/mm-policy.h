@@ -0,0 +1,162 @@
+/*
+ * mm-policy.h - Compile-time policies for the allocator in mm.c
+ *
+ * mm.c is compiled once per policy. MM_POLICY selects one of the
+ * preconfigured policies below, and MM_PREFIX renames the public
+ * entry points (mm_init -> <prefix>_init, ...) so that several
+ * instantiations can be linked into the same mdriver binary.
+ *
+ * Every knob is a constant, so the choices are resolved by the
+ * preprocessor and the compiler and cost nothing at run time:
+ *
+ *   CHUNKSIZE     bytes to extend the heap by when no fit is found
+ *   SPLIT_MIN     smallest remainder worth splitting off as a free block
+ *   FIT           FIT_FIRST or FIT_BEST placement within a size class
+ *   NUM_CLASSES   number of segregated free lists
+ *   CLASS_LIMITS  largest block size (bytes) held by each of the
+ *                 first NUM_CLASSES-1 lists; the last list holds the rest
+ *   PREFETCH_FIT  software-prefetch the next free block while find_fit
+ *                 examines the current one
+ *   SIZE_HINTS    keep the size of the next free block next to the list
+ *                 links, so find_fit can reject it without reading its
+ *                 header (raises the minimum block size to 24 bytes)
+ *   GROW_ADAPTIVE size heap growth from the observed demand instead of
+ *                 always growing by CHUNKSIZE (see mm.c). The step moves
+ *                 between CHUNKSIZE and GROW_MAX; it doubles after
+ *                 GROW_STREAK growths in a row that each came fewer than
+ *                 GROW_FAST allocations after the one before, halves when
+ *                 more than GROW_SLOW allocations came between growths,
+ *                 and is at least GROW_BATCH average requests but at
+ *                 most 1/GROW_RATIO of the heap (or CHUNKSIZE)
+ *   BG_COALESCE   free blocks from a helper thread (see mm.c); mm_free
+ *                 only queues the block
+ *   THREAD_SAFE   take a mutex in every entry point, so that several
+ *                 threads can share the heap (always on with BG_COALESCE)
+ *   TRIM_THRESHOLD smallest free block at the end of the heap whose
+ *                 pages the helper gives back to the OS
+ *   TRIM_IDLE     microseconds between the helper's turns; a turn that
+ *                 finds the free queue empty trims the heap tail and puts
+ *                 the helper to sleep until the next mm_free
+ *   FREE_BATCH    most blocks the helper frees per turn of the heap lock
+ *   NT_COPY_MIN   smallest payload that mm_realloc moves with streaming
+ *                 (non-temporal) SSE2 or AVX stores, which bypass the
+ *                 cache, on CPUs that have them; 0 always uses memmove
+ *   LINE_SIZE     cache line size that MM_ALIGN_LINE blocks are aligned
+ *                 and padded to (a power of two)
+ *   LINE_AUTO     give a request for less than a line MM_ALIGN_LINE when
+ *                 the previous such request came from another thread,
+ *                 so that threads allocating in turn do not share lines
+ */
+#ifndef __MM_POLICY_H_
+#define __MM_POLICY_H_
+
+/* Fit policies */
+#define FIT_FIRST 0
+#define FIT_BEST  1
+
+/* Preconfigured policies */
+#define POLICY_FIRSTFIT 0   /* the original single explicit list, first fit */
+#define POLICY_SEGFIT   1   /* segregated lists, first fit within a class */
+#define POLICY_BESTFIT  2   /* segregated lists, best fit, bigger chunks */
+#define POLICY_PREFETCH 3   /* first fit with prefetching and size hints */
+#define POLICY_BACKGROUND 4 /* segregated lists, background coalescing */
+#define POLICY_ADAPTIVE 5   /* segregated lists, adaptive heap growth */
+
+#ifndef MM_POLICY
+#define MM_POLICY POLICY_FIRSTFIT
+#endif
+
+#if MM_POLICY == POLICY_FIRSTFIT
+#define CHUNKSIZE    (1<<12)
+#define SPLIT_MIN    16
+#define FIT          FIT_FIRST
+#define NUM_CLASSES  1
+#define CLASS_LIMITS { 0 }
+#elif MM_POLICY == POLICY_SEGFIT
+#define CHUNKSIZE    (1<<12)
+#define SPLIT_MIN    16
+#define FIT          FIT_FIRST
+#define NUM_CLASSES  9
+#define CLASS_LIMITS { 16, 32, 64, 128, 256, 512, 1024, 4096 }
+#elif MM_POLICY == POLICY_BESTFIT
+#define CHUNKSIZE    (1<<13)
+#define SPLIT_MIN    24
+#define FIT          FIT_BEST
+#define NUM_CLASSES  6
+#define CLASS_LIMITS { 32, 128, 512, 2048, 8192 }
+#elif MM_POLICY == POLICY_PREFETCH
+#define CHUNKSIZE    (1<<12)
+#define SPLIT_MIN    24
+#define FIT          FIT_FIRST
+#define NUM_CLASSES  1
+#define CLASS_LIMITS { 0 }
+#define PREFETCH_FIT 1
+#define SIZE_HINTS   1
+#elif MM_POLICY == POLICY_BACKGROUND
+#define CHUNKSIZE    (1<<12)
+#define SPLIT_MIN    16
+#define FIT          FIT_FIRST
+#define NUM_CLASSES  9
+#define CLASS_LIMITS { 16, 32, 64, 128, 256, 512, 1024, 4096 }
+#define BG_COALESCE  1
+#define TRIM_THRESHOLD (1<<16)
+#define TRIM_IDLE    1000
+#define FREE_BATCH   64
+#define LINE_AUTO    1
+#elif MM_POLICY == POLICY_ADAPTIVE
+#define CHUNKSIZE    (1<<12)
+#define SPLIT_MIN    16
+#define FIT          FIT_FIRST
+#define NUM_CLASSES  9
+#define CLASS_LIMITS { 16, 32, 64, 128, 256, 512, 1024, 4096 }
+#define GROW_ADAPTIVE 1
+#define GROW_MAX     (1<<18)
+#define GROW_FAST    16
+#define GROW_STREAK  4
+#define GROW_SLOW    256
+#define GROW_BATCH   4
+#define GROW_RATIO   4
+#else
+#error "mm-policy.h: unknown MM_POLICY"
+#endif
+
+/* Knobs that most policies leave off */
+#ifndef PREFETCH_FIT
+#define PREFETCH_FIT 0
+#endif
+#ifndef SIZE_HINTS
+#define SIZE_HINTS   0
+#endif
+#ifndef BG_COALESCE
+#define BG_COALESCE  0
+#endif
+#ifndef THREAD_SAFE
+#define THREAD_SAFE  BG_COALESCE
+#endif
+#if BG_COALESCE && !THREAD_SAFE
+#error "mm-policy.h: BG_COALESCE needs THREAD_SAFE"
+#endif
+#ifndef GROW_ADAPTIVE
+#define GROW_ADAPTIVE 0
+#endif
+#ifndef LINE_AUTO
+#define LINE_AUTO    0
+#endif
+
+/*
+ * Knobs that every policy shares. "copybench -m" moved 64K-512K blocks
+ * with streaming stores at under half the memmove rate, with no gain in
+ * re-reading a hot set afterwards (2 MB L2). Streaming only came out
+ * ahead from 2 MB up, so it starts at 1 MB.
+ */
+#ifndef NT_COPY_MIN
+#define NT_COPY_MIN  (1<<20)
+#endif
+#ifndef LINE_SIZE
+#define LINE_SIZE    64
+#endif
+
+/* Renames the entry points when MM_PREFIX is set */
+#include "mm-prefix.h"
+
+#endif /* __MM_POLICY_H_ */
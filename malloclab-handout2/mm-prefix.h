@@ -0,0 +1,32 @@
+/*
+ * mm-prefix.h - Renames the public entry points of an allocator when
+ * it is compiled with -DMM_PREFIX=<prefix> (mm_init -> <prefix>_init,
+ * ...), so that several allocators, or several instantiations of one,
+ * can be linked into the same mdriver binary. It must be seen before
+ * mm.h so the prototypes are renamed too.
+ */
+#ifndef __MM_PREFIX_H_
+#define __MM_PREFIX_H_
+
+#ifdef MM_PREFIX
+#define MM_CAT2(a, b) a##b
+#define MM_CAT(a, b)  MM_CAT2(a, b)
+#define mm_init       MM_CAT(MM_PREFIX, _init)
+#define mm_malloc     MM_CAT(MM_PREFIX, _malloc)
+#define mm_malloc_flags MM_CAT(MM_PREFIX, _malloc_flags)
+#define mm_free       MM_CAT(MM_PREFIX, _free)
+#define mm_realloc    MM_CAT(MM_PREFIX, _realloc)
+#define mm_deinit     MM_CAT(MM_PREFIX, _deinit)
+#define mm_checkheap  MM_CAT(MM_PREFIX, _checkheap)
+#define mm_heapstats  MM_CAT(MM_PREFIX, _heapstats)
+#define mm_attach     MM_CAT(MM_PREFIX, _attach)
+#define mm_set_root   MM_CAT(MM_PREFIX, _set_root)
+#define mm_get_root   MM_CAT(MM_PREFIX, _get_root)
+#define printfreelist MM_CAT(MM_PREFIX, _printfreelist)
+#define mm_prof_start MM_CAT(MM_PREFIX, _prof_start)
+#define mm_prof_stop  MM_CAT(MM_PREFIX, _prof_stop)
+#define mm_prof_dump  MM_CAT(MM_PREFIX, _prof_dump)
+#define team          MM_CAT(MM_PREFIX, _team)
+#endif
+
+#endif /* __MM_PREFIX_H_ */
@@ -34,18 +34,92 @@
  *  -------------------------------------------------------------------
  *
  * The free list is a doubly linked list with NULL pointers at each end
- * of the list. When blocks are freed they are inserted at the front of 
- * the list. The list is traversed using a struct that consists of two
+ * of the list. The prev and next links are stored as offsets from the
+ * start of the heap, with 0 for NULL, so the heap does not depend on
+ * the address it is mapped at. When blocks are freed they are inserted
+ * at the front of the list. The list is traversed using a struct that consists of two
  * pointers, prev and next.
  * When memory is allocated the list is searched for a block big enough
  * using a first fit search. 
  *
+ * The start of the heap holds the allocator's roots (heap_listp and the
+ * free list heads, also as offsets) in front of the padding word:
+ *
+ *  ------------------------------------------------------------------
+ * | roots | pad | hdr(8:a) | ftr(8:a) | zero or more usr blks | hdr(8:a) |
+ *  ------------------------------------------------------------------
+ *
+ * so a heap image that memlib keeps in a file mapping can be picked up
+ * again by a new process with mm_attach.
+ *
+ * A heap in shared memory (mem_init_shared) is built by one process and
+ * attached by the others, which may map it at other addresses. Any of
+ * them can free a block another one allocated. The roots then also hold
+ * a robust process-shared mutex that every entry point takes.
+ *
+ * The constants that tune the allocator (CHUNKSIZE, the split threshold,
+ * the fit policy and the size classes) come from mm-policy.h. A policy
+ * with more than one size class keeps one such list per class and a
+ * block lives on the list of the class its size falls in.
+ *
+ * With GROW_ADAPTIVE the heap does not always grow by CHUNKSIZE. The
+ * step doubles while the heap keeps running out after only a few
+ * allocations and halves again when growth is rare. It is never less
+ * than a few average requests or more than a fraction of the heap, and
+ * a free block at the end of the heap is counted towards the request.
+ *
+ * The allocation sampler (mm_prof_start) records a stack backtrace for
+ * about one allocation per sample interval of requested bytes. Sampled
+ * blocks carry the SAMPLED bit in their header and footer, and their
+ * records are kept in a hash table in libc memory until they are freed.
+ * mm_prof_dump writes the live records as a pprof heap profile. When
+ * the sampler is off, mm_malloc pays one decrement and one branch that
+ * is never taken, and mm_free one test of the header it reads anyway.
+ *
+ * With BG_COALESCE, mm_free only pushes the block onto a lock-free
+ * queue. A helper thread drains the queue, frees and coalesces the
+ * blocks in address order and gives the pages of a large free block at
+ * the end of the heap back to the OS when it is idle. The heap itself
+ * is then protected by a mutex, taken by mm_malloc, mm_realloc and the
+ * helper, and the queue only holds blocks freed by this process. Other
+ * policies take the same mutex in every entry point when built with
+ * THREAD_SAFE.
+ *
+ * This trades malloc latency for free latency: mm_malloc may wait for
+ * the lock while the helper frees a batch of FREE_BATCH blocks.
+ *
+ * mm_malloc_flags with MM_ALIGN_LINE starts the payload on a cache line
+ * and pads it to whole lines, carving the block out of a free block at
+ * an aligned address. With LINE_AUTO small requests get this treatment
+ * whenever the thread asking differs from the one that asked last.
+ *
+ * When mm_realloc has to move a payload of NT_COPY_MIN bytes or more it
+ * copies it with streaming stores, AVX or SSE2 as the CPU allows, so
+ * that a large move does not push the caller's working set out of the
+ * cache with data nobody is going to read soon.
+ *
  */
+#include "mm-policy.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <execinfo.h>
+#include <errno.h>
+#include <pthread.h>
+#if BG_COALESCE
+#include <time.h>
+#endif
+#if NT_COPY_MIN && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define NT_COPY     1
+#else
+#define NT_COPY     0
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -84,11 +158,29 @@ team_t team = {
 /* Basic constants and macros */
 #define WSIZE       4       /* word size (bytes) */  
 #define DSIZE       8       /* doubleword size (bytes) */
-#define CHUNKSIZE  (1<<12)  /* initial heap size (bytes) */
 #define OVERHEAD    8       /* overhead of header and footer (bytes) */
-#define MINIMUM		16		/* minimum size of block */
+
+/* Smallest block that can hold the free list fields (see struct pointers) */
+#if SIZE_HINTS
+#define MIN_BLOCK   24
+#else
+#define MIN_BLOCK   (DSIZE + OVERHEAD)
+#endif
+
+/* Ask the cache for the line at address p ahead of its use */
+#if PREFETCH_FIT
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p)
+#endif
+
+/* Serialize access to the heap when several threads use it (THREAD_SAFE)
+   or other processes share the heap, see lockHeap */
+#define LOCK()      lockHeap()
+#define UNLOCK()    unlockHeap()
 
 #define MAX(x, y) ((x) > (y)? (x) : (y)) 
+#define MIN(x, y) ((x) < (y)? (x) : (y)) 
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
@@ -101,6 +193,10 @@ team_t team = {
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
+/* Set in the header and footer of an allocated block the sampler recorded */
+#define SAMPLED      0x2
+#define GET_SAMPLED(p) (GET(p) & SAMPLED)
+
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)  
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
@@ -110,28 +206,142 @@ team_t team = {
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 /* $end mallocmacros */
 
+/* Convert between block pointers and heap offsets, 0 stands for NULL */
+#define TO_OFF(bp)   ((bp) == NULL ? 0 : (unsigned)((char *)(bp) - heap_base))
+#define TO_PTR(off)  ((off) == 0 ? NULL : (blockPtr *)(heap_base + (off)))
+#define PREV_FREE(p) TO_PTR((p)->prev)
+#define NEXT_FREE(p) TO_PTR((p)->next)
+
+/* The roots at the start of the heap, see the comment at the top */
+#define ROOTS_MAGIC 0x6d6d4850 /* "mmHP" */
+
+typedef struct {
+	unsigned magic;       /* ROOTS_MAGIC once the heap is initialized */
+	unsigned policy;      /* MM_POLICY the heap was built with */
+	unsigned heap_off;    /* offset of heap_listp */
+	unsigned user_off;    /* offset of the application's root block */
+	unsigned free_off[NUM_CLASSES]; /* first free block of each class */
+	pthread_mutex_t lock; /* heap lock if the heap is shared */
+} roots_t;
+
+#define ROOTS_SIZE  (DSIZE * ((sizeof(roots_t) + DSIZE - 1) / DSIZE))
+
 /* Global variables */
 static char *heap_listp;  /* pointer to first block */
-static char *free_listp; /* pointer to first free block */
+static char *heap_base;   /* start of the heap, offsets count from here */
+static roots_t *roots;    /* the roots at heap_base */
+static pthread_mutex_t *shared_lock; /* lock in the roots of a shared heap */
+
+/* Counts the errors found by the heap checker */
+static int check_errors;
+#define CHECK_ERROR(...) (check_errors++, printf(__VA_ARGS__))
+
+/* Largest block size of each size class but the last (see mm-policy.h) */
+static const size_t class_limits[] = CLASS_LIMITS;
+
+/* Allocation sampler */
+#define PROF_DEPTH   32     /* deepest stack recorded */
+#define PROF_BUCKETS 4093   /* buckets in the record hash table */
+
+typedef struct profrec {
+	void *bp;               /* the sampled block */
+	size_t size;            /* requested payload size */
+	int depth;              /* number of frames in stack */
+	void *stack[PROF_DEPTH];
+	struct profrec *next;   /* next record in the same bucket */
+} profrec_t;
+
+static long prof_countdown = LONG_MAX; /* bytes until the next sample */
+static size_t prof_interval;           /* mean bytes between samples, 0 if off */
+static unsigned long long prof_rng = 0x9e3779b97f4a7c15ULL; /* xorshift64* */
+static profrec_t *prof_table[PROF_BUCKETS];
+
+#if GROW_ADAPTIVE
+static size_t grow_chunk;  /* current heap growth step */
+static size_t avg_request; /* moving average of adjusted request sizes */
+static size_t grow_ops;    /* allocations since the heap last grew */
+static int grow_streak;    /* consecutive growths after few allocations */
+#endif
+
+#if LINE_AUTO
+static pthread_t last_small; /* thread of the last request below a line */
+#endif
+
+#if THREAD_SAFE
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#if BG_COALESCE
+static pthread_once_t helper_once = PTHREAD_ONCE_INIT;
+static char *volatile free_queue; /* blocks waiting for the helper */
+static char *free_sorted;         /* taken off the queue, sorted, not freed */
+static pthread_mutex_t sort_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t helper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helper_wake = PTHREAD_COND_INITIALIZER;
+static volatile int helper_parked; /* helper waits for mm_free to wake it */
+static char *trimmed_tail;        /* tail block the helper last trimmed */
+static size_t trimmed_size;       /* ... and its size at the time */
+#endif
 
 /* function prototypes for internal helper routines */
 static void *extend_heap(size_t words);
+static size_t growSize(size_t asize);
 static void place(void *bp, size_t asize);
 static void *find_fit(size_t asize);
 static void *coalesce(void *bp);
 static void printblock(void *bp); 
-static void checkblock(void *bp);
+static void checkblock(void *bp, int fast);
+static int checkHeap(int verbose, int fast);
+static void initLocals(void);
+static void lockHeap(void);
+static void unlockHeap(void);
+static void switchLock(pthread_mutex_t *lock);
 static void insertBlock(void *bp);
 static void removeBlock(void *bp);
 typedef struct pointers blockPtr;
 static void checkfreeblock(blockPtr *p);
 static int inFreelist(void *bp);
+static int sizeClass(size_t size);
+static void *mallocBlock(size_t size);
+static void *mallocAligned(size_t size);
+static void *findAlignedFit(size_t asize);
+static size_t alignLead(char *bp);
+static void freeBlock(void *bp);
+static void *reallocBlock(void *ptr, size_t size);
+static void moveData(void *dst, const void *src, size_t n);
+#if NT_COPY
+static void streamSSE2(void *dst, const void *src, size_t n);
+static void streamAVX(void *dst, const void *src, size_t n);
+#endif
+static void profSample(void *bp, size_t size);
+static void profRecord(void *bp, size_t size);
+static void profForget(void *bp);
+static void profClear(void);
+static int profCompare(const void *a, const void *b);
+#if BG_COALESCE
+static void startHelper(void);
+static void *helper(void *arg);
+static int drainFreeQueue(void);
+static void sortFreeQueue(void);
+static int freeBatch(void);
+static char *sortQueue(char *list);
+static char *mergeQueues(char *a, char *b);
+static int ownHeap(void);
+static void trimTail(void);
+#endif
 
 
-/* Structure for our doubly linked list */
+/* 
+ * Structure for our doubly linked list. The links are heap offsets,
+ * use PREV_FREE and NEXT_FREE to follow them. With SIZE_HINTS each block
+ * also caches the size of the block after it on the list.
+ */
 struct pointers {
-	blockPtr *prev;
-	blockPtr *next;
+	unsigned prev;
+	unsigned next;
+#if SIZE_HINTS
+	size_t nextsize; /* size of next, 0 at the end of the list */
+#endif
 };
 
 /* 
@@ -140,29 +350,312 @@ struct pointers {
 /* $begin mminit */
 int mm_init(void) 
 {
+#if BG_COALESCE
+	pthread_once(&helper_once, startHelper);
+#endif
+	LOCK();
+	initLocals();
+	switchLock(NULL);
     /* create the initial empty heap */
-    if ((heap_listp = mem_sbrk(4*WSIZE)) == NULL)
+    if ((heap_base = mem_sbrk(ROOTS_SIZE + 4*WSIZE)) == (void *)-1) {
+		UNLOCK();
         return -1;
+	}
+	heap_listp = heap_base + ROOTS_SIZE;
     PUT(heap_listp, 0);                        /* alignment padding */
     PUT(heap_listp+WSIZE, PACK(OVERHEAD, 1));  /* prologue header */ 
     PUT(heap_listp+DSIZE, PACK(OVERHEAD, 1));  /* prologue footer */ 
     PUT(heap_listp+WSIZE+DSIZE, PACK(0, 1));   /* epilogue header */
     heap_listp += DSIZE;
 	
-	free_listp = NULL; /* Initialize free_listp */
+	/* Initialize the roots, with empty free lists */
+	roots = (roots_t *)heap_base;
+	memset(roots, 0, sizeof(roots_t));
+	roots->policy = MM_POLICY;
+	roots->heap_off = TO_OFF(heap_listp);
+	
+	/* A heap that other processes map too is locked by a robust mutex,
+	   so that a process dying with the lock held does not hang them */
+	if (mem_shared()) {
+		pthread_mutexattr_t attr;
+		
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&roots->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		switchLock(&roots->lock);
+	}
 
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
+    if (extend_heap(CHUNKSIZE/WSIZE) == NULL) {
+		UNLOCK();
         return -1;
+	}
+	/* Other processes can attach once the magic is there */
+	__sync_synchronize();
+	roots->magic = ROOTS_MAGIC;
+	UNLOCK();
     return 0;
 }
 /* $end mminit */
 
+/*
+ * mm_attach - Resume using a heap that was built by mm_init in an earlier
+ * process, e.g. one memlib mapped back from a file (mem_init_file), or
+ * start using a heap that another process built in shared memory 
+ * (mem_init_shared). The heap may be at a different address than in the
+ * process that built it. Returns -1 if the heap was not built (yet) by
+ * this policy or fails the heap check.
+ */
+int mm_attach(void)
+{
+	roots_t *r = mem_heap_lo();
+	int errors;
+	
+	if (mem_heapsize() < ROOTS_SIZE + 4*WSIZE || r->magic != ROOTS_MAGIC
+		|| r->policy != MM_POLICY || r->heap_off >= mem_heapsize())
+		return -1;
+#if BG_COALESCE
+	pthread_once(&helper_once, startHelper);
+#endif
+	LOCK();
+	initLocals();
+	switchLock(mem_shared() ? &r->lock : NULL);
+	roots = r;
+	heap_base = (char *)r;
+	heap_listp = heap_base + r->heap_off;
+	errors = checkHeap(0, 1);
+	UNLOCK();
+	return errors ? -1 : 0;
+}
+
+/*
+ * mm_deinit - Stop using the heap, so that the memory system can be 
+ * reset and given to someone else. The helper thread frees the blocks
+ * still on the queue first and then leaves the memory alone.
+ */
+void mm_deinit(void)
+{
+#if BG_COALESCE
+	/* Wait for a batch the helper is sorting outside the heap lock */
+	pthread_mutex_lock(&sort_lock);
+#endif
+	LOCK();
+#if BG_COALESCE
+	if (ownHeap())
+		drainFreeQueue();
+	free_queue = NULL;
+	free_sorted = NULL;
+#endif
+	switchLock(NULL);
+	heap_base = NULL;
+	UNLOCK();
+#if BG_COALESCE
+	pthread_mutex_unlock(&sort_lock);
+#endif
+}
+
+/*
+ * mm_set_root, mm_get_root - Remember one block of the application in
+ * the heap roots, so that it can find its data again after mm_attach
+ */
+void mm_set_root(void *bp)
+{
+	roots->user_off = TO_OFF(bp);
+}
+
+void *mm_get_root(void)
+{
+	return TO_PTR(roots->user_off);
+}
+
 /* 
  * mm_malloc - Allocate a block with at least size bytes of payload 
  */
 /* $begin mmmalloc */
 void *mm_malloc(size_t size) 
+{
+	return mm_malloc_flags(size, 0);
+} 
+/* $end mmmalloc */
+
+/*
+ * mm_malloc_flags - Allocate a block with at least size bytes of payload
+ * as flags ask for, see mm.h
+ */
+void *mm_malloc_flags(size_t size, int flags)
+{
+	void *bp;
+	
+	LOCK();
+#if LINE_AUTO
+	if (size < LINE_SIZE) {
+		pthread_t self = pthread_self();
+		
+		if (!pthread_equal(self, last_small))
+			flags |= MM_ALIGN_LINE;
+		last_small = self;
+	}
+#endif
+	if (flags & MM_ALIGN_LINE)
+		bp = mallocAligned(size);
+	else
+		bp = mallocBlock(size);
+	if ((prof_countdown -= (long)size) < 0 && bp != NULL)
+		profSample(bp, size);
+	UNLOCK();
+	return bp;
+}
+
+/* 
+ * mm_free - Free a block. With BG_COALESCE the block is only queued
+ * for the helper thread, which takes constant time.
+ */
+/* $begin mmfree */
+void mm_free(void *bp)
+{
+#if BG_COALESCE
+	char *head;
+#endif
+	
+	if (GET_SAMPLED(HDRP(bp))) {
+		LOCK();
+		profForget(bp);
+		UNLOCK();
+	}
+#if BG_COALESCE
+	/* Push onto the lock-free queue, linked through the payload */
+	do {
+		head = free_queue;
+		*(char **)bp = head;
+	} while (!__sync_bool_compare_and_swap(&free_queue, head, (char *)bp));
+	/* Wake the helper if it has gone to sleep for good */
+	if (helper_parked) {
+		pthread_mutex_lock(&helper_lock);
+		pthread_cond_signal(&helper_wake);
+		pthread_mutex_unlock(&helper_lock);
+	}
+#else
+	LOCK();
+	freeBlock(bp);
+	UNLOCK();
+#endif
+}
+/* $end mmfree */
+
+/*
+ * mm_realloc - Reallocate a block, see reallocBlock.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+	void *newp;
+	
+	LOCK();
+	/* The sampler sees a realloc as a free and a new allocation */
+	if (ptr != NULL && GET_SAMPLED(HDRP(ptr)))
+		profForget(ptr);
+	newp = reallocBlock(ptr, size);
+	if ((prof_countdown -= (long)size) < 0 && newp != NULL && size > 0)
+		profSample(newp, size);
+	UNLOCK();
+	return newp;
+}
+
+/*
+ * mm_prof_start - Start sampling about one allocation per interval
+ * bytes of requested payload. Calling it again changes the interval
+ * and keeps the records taken so far.
+ */
+void mm_prof_start(size_t interval)
+{
+	LOCK();
+	prof_interval = interval;
+	prof_countdown = interval;
+	UNLOCK();
+}
+
+/*
+ * mm_prof_stop - Stop taking samples and drop the records
+ */
+void mm_prof_stop(void)
+{
+	LOCK();
+	prof_interval = 0;
+	prof_countdown = LONG_MAX;
+	profClear();
+	UNLOCK();
+}
+
+/*
+ * mm_prof_dump - Write the live sampled allocations to fp as a heap
+ * profile in the text format pprof reads (heap_v2). Records with the
+ * same stack are merged. Each sample stands for the 1/(1-exp(-size/
+ * interval)) allocations of its size that the sampler would have
+ * skipped on average, and its counts are scaled by that.
+ */
+void mm_prof_dump(FILE *fp)
+{
+	profrec_t **recs;
+	profrec_t *r;
+	double objs = 0, bytes = 0;
+	int i, j, k, n = 0;
+	FILE *maps;
+	char line[512];
+	
+	LOCK();
+	for (i = 0; i < PROF_BUCKETS; i++)
+		for (r = prof_table[i]; r != NULL; r = r->next)
+			n++;
+	if ((recs = malloc((n + 1) * sizeof(profrec_t *))) == NULL) {
+		UNLOCK();
+		return;
+	}
+	n = 0;
+	for (i = 0; i < PROF_BUCKETS; i++)
+		for (r = prof_table[i]; r != NULL; r = r->next)
+			recs[n++] = r;
+	qsort(recs, n, sizeof(profrec_t *), profCompare);
+	
+	/* Totals for the header line */
+	for (i = 0; i < n; i++) {
+		double scale = 1 / (1 - exp(-(double)recs[i]->size / prof_interval));
+		objs += scale;
+		bytes += scale * recs[i]->size;
+	}
+	fprintf(fp, "heap profile: %.0f: %.0f [%.0f: %.0f] @ heap_v2/%lu\n",
+		objs, bytes, objs, bytes, (unsigned long)prof_interval);
+	
+	/* One line per distinct stack */
+	for (i = 0; i < n; i = j) {
+		objs = bytes = 0;
+		for (j = i; j < n && profCompare(&recs[i], &recs[j]) == 0; j++) {
+			double scale = 1 / (1 - exp(-(double)recs[j]->size / prof_interval));
+			objs += scale;
+			bytes += scale * recs[j]->size;
+		}
+		fprintf(fp, "%.0f: %.0f [%.0f: %.0f] @", objs, bytes, objs, bytes);
+		for (k = 0; k < recs[i]->depth; k++)
+			fprintf(fp, " %p", recs[i]->stack[k]);
+		fprintf(fp, "\n");
+	}
+	UNLOCK();
+	free(recs);
+	
+	/* pprof maps the addresses back to symbols with these */
+	fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+	if ((maps = fopen("/proc/self/maps", "r")) != NULL) {
+		while (fgets(line, sizeof(line), maps) != NULL)
+			fputs(line, fp);
+		fclose(maps);
+	}
+}
+
+/* 
+ * mallocBlock - Allocate a block with at least size bytes of payload.
+ * The caller holds the heap lock.
+ */
+static void *mallocBlock(size_t size) 
 {
     size_t asize;      /* adjusted block size */
     size_t extendsize; /* amount to extend heap if no fit */
@@ -174,9 +667,13 @@ void *mm_malloc(size_t size)
 
     /* Adjust block size to include overhead and alignment reqs. */
     if (size <= DSIZE)
-        asize = DSIZE + OVERHEAD;
+        asize = MIN_BLOCK;
     else
-        asize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
+        asize = MAX(MIN_BLOCK, DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE));
+#if GROW_ADAPTIVE
+	avg_request = avg_request - avg_request / 8 + asize / 8;
+	grow_ops++;
+#endif
     
     /* Search the free list for a fit */
     if ((bp = find_fit(asize)) != NULL) {
@@ -184,20 +681,64 @@ void *mm_malloc(size_t size)
         return bp;
     }
 
+#if BG_COALESCE
+	/* Free the queued blocks ourselves before growing the heap */
+	if (drainFreeQueue() && (bp = find_fit(asize)) != NULL) {
+		place(bp, asize);
+		return bp;
+	}
+#endif
+
     /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize,CHUNKSIZE);
+    extendsize = growSize(asize);
     if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
         return NULL;
     place(bp, asize);
     return bp;
 } 
-/* $end mmmalloc */
+
+/*
+ * mallocAligned - Allocate a block whose payload starts on a cache line
+ * and fills whole lines, so that no other payload shares a line with it.
+ * A free block that is too small in front of the aligned address is
+ * split off. The caller holds the heap lock.
+ */
+static void *mallocAligned(size_t size)
+{
+	size_t asize, csize, lead;
+	char *bp;
+	
+	if (size <= 0)
+		return NULL;
+	asize = LINE_SIZE * ((size + LINE_SIZE - 1) / LINE_SIZE) + OVERHEAD;
+	
+	if ((bp = findAlignedFit(asize)) == NULL) {
+		/* Enough for the block wherever the new memory starts */
+		if ((bp = extend_heap((asize + LINE_SIZE + MIN_BLOCK)/WSIZE)) == NULL)
+			return NULL;
+	}
+	
+	/* Split off the part in front of the aligned address */
+	if ((lead = alignLead(bp)) > 0) {
+		csize = GET_SIZE(HDRP(bp));
+		removeBlock(bp);
+		PUT(HDRP(bp), PACK(lead, 0));
+		PUT(FTRP(bp), PACK(lead, 0));
+		insertBlock(bp);
+		bp = NEXT_BLKP(bp);
+		PUT(HDRP(bp), PACK(csize - lead, 0));
+		PUT(FTRP(bp), PACK(csize - lead, 0));
+		insertBlock(bp);
+	}
+	place(bp, asize);
+	return bp;
+}
 
 /* 
- * mm_free - Free a block 
+ * freeBlock - Free a block and coalesce it with its neighbours.
+ * The caller holds the heap lock.
  */
-/* $begin mmfree */
-void mm_free(void *bp)
+static void freeBlock(void *bp)
 {
     size_t size = GET_SIZE(HDRP(bp));
 
@@ -206,36 +747,35 @@ void mm_free(void *bp)
     coalesce(bp);
 }
 
-/* $end mmfree */
-
 /*
- * mm_realloc - Reallocate a block.
+ * reallocBlock - Reallocate a block.
  * Accepts a pointer to a block and a size.
  * If the size is smaller than the block was before the block is shrunk.
  * If the size is greater than before the block is extended.  
+ * The caller holds the heap lock.
  */
-void *mm_realloc(void *ptr, size_t size)
+static void *reallocBlock(void *ptr, size_t size)
 {
 	/* If ptr is NULL we just call malloc */
 	if(ptr == NULL)
 	{
-		return mm_malloc(size);
+		return mallocBlock(size);
 	}
 	/* If size is less than or eaqual to 0 we just call free */
 	if(size <= 0)
 	{
-		free(ptr);
+		freeBlock(ptr);
 		return 0;
 	}
 	/* We adjust block size to include overhead and alignment requirements */
 	size_t newsize;
 	if (size <= DSIZE)
 	{
-		newsize = DSIZE + OVERHEAD;
+		newsize = MIN_BLOCK;
 	}  
     else
 	{
-		newsize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
+		newsize = MAX(MIN_BLOCK, DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE));
 	}
 	
     void *newp;
@@ -249,7 +789,7 @@ void *mm_realloc(void *ptr, size_t size)
 	}
 	/* If the payload is reduced in size and there is sufficient space
 	   for another block we create a free block after the block. */
-	if(newsize + MINIMUM <= copySize)
+	if(newsize + SPLIT_MIN <= copySize)
 	{
 		PUT(HDRP(ptr), PACK(newsize, 1));
 		PUT(FTRP(ptr), PACK(newsize, 1));
@@ -285,7 +825,7 @@ void *mm_realloc(void *ptr, size_t size)
 		newp = PREV_BLKP(ptr);
 		PUT(HDRP(newp), PACK(newsize + freesize, 1));
 		PUT(FTRP(newp), PACK(newsize + freesize, 1));
-		memcpy(newp, ptr, copySize);
+		moveData(newp, ptr, copySize - OVERHEAD);
 		return newp;
 	}
 	
@@ -303,7 +843,7 @@ void *mm_realloc(void *ptr, size_t size)
 		newp = PREV_BLKP(ptr);
 		PUT(HDRP(newp), PACK(newsize + freesize, 1));
 		PUT(FTRP(newp), PACK(newsize + freesize, 1));
-		memcpy(newp, ptr, copySize);
+		moveData(newp, ptr, copySize - OVERHEAD);
 		return newp;
 	}
 		
@@ -312,79 +852,171 @@ void *mm_realloc(void *ptr, size_t size)
 	   the size of the block and create a free block from the leftover space. */
 	if((newsize > copySize) && (GET_SIZE(HDRP(NEXT_BLKP(ptr))) == 0))
 	{
-		if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
+		if (extend_heap(MAX(newsize - copySize, CHUNKSIZE)/WSIZE) == NULL)
 		{
 			return NULL;
 		}
 		size_t freesize = GET_SIZE(HDRP(NEXT_BLKP(ptr))) - (newsize - copySize);
 		
 		removeBlock(NEXT_BLKP(ptr));
+		/* A leftover too small for a block stays with ptr */
+		if (freesize < SPLIT_MIN)
+		{
+			newsize += freesize;
+			freesize = 0;
+		}
 		PUT(HDRP(ptr), PACK(newsize, 1));
 		PUT(FTRP(ptr), PACK(newsize, 1));
-		PUT(HDRP(NEXT_BLKP(ptr)), PACK(freesize, 1));
-		PUT(FTRP(NEXT_BLKP(ptr)), PACK(freesize, 1));
-		mm_free(NEXT_BLKP(ptr));
+		if (freesize > 0)
+		{
+			PUT(HDRP(NEXT_BLKP(ptr)), PACK(freesize, 1));
+			PUT(FTRP(NEXT_BLKP(ptr)), PACK(freesize, 1));
+			freeBlock(NEXT_BLKP(ptr));
+		}
 		return ptr;
 	}
 	/* If none of the previous cases apply, we call malloc and then free
        the old block. */
 	else
 	{
-		if ((newp = mm_malloc(size)) == NULL) {
+		if ((newp = mallocBlock(size)) == NULL) {
 			printf("ERROR: mm_malloc failed in mm_realloc\n");
 			exit(1);
 		}
 		
+		copySize -= OVERHEAD;
 		if (size < copySize)
 			copySize = size;
-		memcpy(newp, ptr, copySize);
-		mm_free(ptr);
+		moveData(newp, ptr, copySize);
+		freeBlock(ptr);
 		return newp;
 	}
 }
 
-/* 
- * mm_checkheap - Check the heap for consistency 
+/*
+ * moveData - Copy the n byte payload at src to dst for reallocBlock.
+ * dst may overlap src from below. Large copies that can run front to
+ * back go through streaming stores when the CPU has them.
  */
-void mm_checkheap(int verbose) 
+static void moveData(void *dst, const void *src, size_t n)
 {
-    char *bp = heap_listp;
+#if NT_COPY
+	static void (*stream)(void *, const void *, size_t);
+	static int picked;
+	
+	if (!picked) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx"))
+			stream = streamAVX;
+		else if (__builtin_cpu_supports("sse2"))
+			stream = streamSSE2;
+		picked = 1;
+	}
+	if (n >= NT_COPY_MIN && stream != NULL
+		&& ((char *)dst < (char *)src || (char *)dst >= (char *)src + n)) {
+		stream(dst, src, n);
+		return;
+	}
+#endif
+	memmove(dst, src, n);
+}
 
-    if (verbose)
-        printf("Heap (%p):\n", heap_listp);
+#if NT_COPY
+/*
+ * streamSSE2, streamAVX - Copy n bytes front to back with streaming
+ * stores, 64 or 128 bytes per step. Every step loads before it stores,
+ * so dst may overlap src from below. The ends that are not aligned for
+ * the stores are copied with memmove.
+ */
+__attribute__((target("sse2")))
+static void streamSSE2(void *dst, const void *src, size_t n)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t head = (16 - ((size_t)d & 15)) & 15;
 	
-	/* Checks if the prologue header is allocated and is the correct size */
-    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
-        printf("Bad prologue header\n");
-	checkblock(heap_listp);
+	memmove(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	_mm_sfence();
+	memmove(d, s, n);
+}
 
-	/* Checks if every block on the heap is aligned correctly and has a
-	   matching header and footer. Checks for contiguous free blocks. 
-	   Checks if every free block is in the free list. */
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (verbose) 
-            printblock(bp);
-        checkblock(bp);
-    }
-     
-    if (verbose)
-        printblock(bp);
-	/* Checks if the epilogue header is allocated and is the correct size */
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
-        printf("Bad epilogue header\n");
+__attribute__((target("avx")))
+static void streamAVX(void *dst, const void *src, size_t n)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t head = (32 - ((size_t)d & 31)) & 31;
 	
-	blockPtr *p = (blockPtr *)free_listp;
-	/* Checks if every block in the free list is marked as free */
-    for (; p != NULL; p = p->next) 
-	{
-		if(GET_ALLOC(p))
-		{
-			printf("Error: %p is not free\n", p);
+	memmove(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= 128; n -= 128, d += 128, s += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)s);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_stream_si256((__m256i *)d, a);
+		_mm256_stream_si256((__m256i *)(d + 32), b);
+		_mm256_stream_si256((__m256i *)(d + 64), c);
+		_mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	_mm_sfence();
+	_mm256_zeroupper();
+	memmove(d, s, n);
+}
+#endif
+
+/* 
+ * mm_checkheap - Check the heap for consistency. Returns the number
+ * of errors found.
+ */
+int mm_checkheap(int verbose) 
+{
+	int errors;
+	
+	LOCK();
+	errors = checkHeap(verbose, 0);
+	UNLOCK();
+	return errors;
+}
+
+/*
+ * mm_heapstats - Add up the free blocks of the heap. With BG_COALESCE
+ * the blocks still waiting on the free queue count as allocated.
+ */
+void mm_heapstats(mm_heapstats_t *hs)
+{
+	char *bp;
+	size_t size;
+
+	memset(hs, 0, sizeof(*hs));
+	LOCK();
+	if (heap_base != NULL) {
+		hs->heap_bytes = mem_heapsize();
+		for (bp = heap_listp; (size = GET_SIZE(HDRP(bp))) > 0;
+		     bp = NEXT_BLKP(bp)) {
+			if (GET_ALLOC(HDRP(bp)))
+				continue;
+			hs->free_bytes += size;
+			hs->free_blocks++;
+			hs->largest_free = MAX(hs->largest_free, size);
 		}
-		/* Checks if prev and next point to addresses within heap bounds
-		  and if the blocks they point to are actually free. */
-		checkfreeblock(p);
-    } 
+	}
+	UNLOCK();
 }
 
 /* The remaining routines are internal helper routines */
@@ -413,6 +1045,190 @@ static void *extend_heap(size_t words)
 }
 /* $end mmextendheap */
 
+/*
+ * checkHeap - Check the heap for consistency and return the number of
+ * errors. The fast check only compares the number of free blocks on 
+ * the heap with the number on the free lists instead of looking up
+ * every free block on its list, and so takes linear time.
+ */
+static int checkHeap(int verbose, int fast)
+{
+    char *bp = heap_listp;
+	char *end = (char *)mem_heap_hi() + 1;
+	int nfree = 0, nlisted = 0;
+	int c;
+
+	check_errors = 0;
+    if (verbose)
+        printf("Heap (%p):\n", heap_listp);
+	
+	/* Checks if the prologue header is allocated and is the correct size */
+    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
+        CHECK_ERROR("Bad prologue header\n");
+	checkblock(heap_listp, fast);
+
+	/* Checks if every block on the heap is aligned correctly and has a
+	   matching header and footer. Checks for contiguous free blocks. 
+	   Checks if every free block is in the free list. Stops at a block
+	   that runs past the end of the heap. */
+    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        if (verbose) 
+            printblock(bp);
+		if (NEXT_BLKP(bp) > end) {
+			CHECK_ERROR("Error: block %p runs past the end of the heap\n", bp);
+			return check_errors;
+		}
+        checkblock(bp, fast);
+		if (!GET_ALLOC(HDRP(bp)))
+			nfree++;
+    }
+     
+    if (verbose)
+        printblock(bp);
+	/* Checks if the epilogue header is allocated, is the correct size
+	   and is at the end of the heap */
+    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))) || bp != end)
+        CHECK_ERROR("Bad epilogue header\n");
+	
+	for (c = 0; c < NUM_CLASSES; c++)
+	{
+		blockPtr *p = TO_PTR(roots->free_off[c]);
+		/* Checks if every block in the free list is marked as free */
+		for (; p != NULL; p = NEXT_FREE(p)) 
+		{
+			/* Stops at a link out of the heap or a cycle */
+			if((char *)p >= end || ++nlisted > nfree)
+			{
+				CHECK_ERROR("Error: free list %d is broken at %p\n", c, p);
+				return check_errors;
+			}
+			if(GET_ALLOC(HDRP(p)))
+			{
+				CHECK_ERROR("Error: %p is not free\n", p);
+			}
+			/* Checks if the block is on the list of its size class */
+			if(sizeClass(GET_SIZE(HDRP(p))) != c)
+			{
+				CHECK_ERROR("Error: %p is on the wrong free list\n", p);
+			}
+#if SIZE_HINTS
+			/* Checks if the size hint matches the next block */
+			if(p->nextsize != (p->next ? GET_SIZE(HDRP(NEXT_FREE(p))) : 0))
+			{
+				CHECK_ERROR("Error: stale size hint in %p\n", p);
+			}
+#endif
+			/* Checks if prev and next point to addresses within heap bounds
+			  and if the blocks they point to are actually free. */
+			checkfreeblock(p);
+		} 
+	}
+	/* Every free block must be on a free list */
+	if(nlisted != nfree)
+	{
+		CHECK_ERROR("Error: %d free blocks but %d on the free lists\n", 
+			nfree, nlisted);
+	}
+	return check_errors;
+}
+
+/*
+ * lockHeap, unlockHeap - Take and release the heap: the mutex of a
+ * THREAD_SAFE build, then the lock of a shared heap. A process that died
+ * holding the shared lock may have left the heap half updated, so the
+ * heap is checked before going on.
+ */
+static void lockHeap(void)
+{
+#if THREAD_SAFE
+	pthread_mutex_lock(&heap_lock);
+#endif
+	if (shared_lock != NULL && pthread_mutex_lock(shared_lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(shared_lock);
+		if (checkHeap(0, 1) != 0)
+			fprintf(stderr, "mm: a process died in the middle of a heap update\n");
+	}
+}
+
+static void unlockHeap(void)
+{
+	if (shared_lock != NULL)
+		pthread_mutex_unlock(shared_lock);
+#if THREAD_SAFE
+	pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+/*
+ * switchLock - Called with the heap locked when this process changes
+ * heaps. Releases the lock of the old heap and takes lock, the lock of
+ * the new heap (NULL if it is private to this process).
+ */
+static void switchLock(pthread_mutex_t *lock)
+{
+	if (shared_lock != NULL)
+		pthread_mutex_unlock(shared_lock);
+	shared_lock = lock;
+	if (lock != NULL && pthread_mutex_lock(lock) == EOWNERDEAD)
+		pthread_mutex_consistent(lock);
+}
+
+/*
+ * initLocals - Reset the state this process keeps about the heap
+ * outside of it, before mm_init builds a heap or mm_attach adopts one
+ */
+static void initLocals(void)
+{
+#if BG_COALESCE
+	/* Blocks still queued belong to the heap we are throwing away */
+	free_queue = NULL;
+	free_sorted = NULL;
+	trimmed_tail = NULL;
+#endif
+	/* Samples from the old heap are gone with it */
+	profClear();
+#if GROW_ADAPTIVE
+	grow_chunk = CHUNKSIZE;
+	avg_request = 0;
+	grow_ops = 0;
+	grow_streak = 0;
+#endif
+}
+
+/*
+ * growSize - Return the number of bytes to extend the heap by when no
+ * free block fits asize
+ */
+static size_t growSize(size_t asize)
+{
+#if GROW_ADAPTIVE
+	char *last = PREV_BLKP((char *)mem_heap_hi() + 1);
+	size_t tail = GET_ALLOC(HDRP(last)) ? 0 : GET_SIZE(HDRP(last));
+	size_t chunk;
+	
+	/* Grow faster while the heap keeps running out quickly, slower 
+	   when it doesn't. A single quick growth is not a trend. */
+	grow_streak = (grow_ops < GROW_FAST) ? grow_streak + 1 : 0;
+	if (grow_streak >= GROW_STREAK && grow_chunk < GROW_MAX)
+		grow_chunk *= 2;
+	else if (grow_ops > GROW_SLOW && grow_chunk > CHUNKSIZE)
+		grow_chunk /= 2;
+	grow_ops = 0;
+	
+	/* A request bigger than the step gets just what it needs. Otherwise
+	   make room for at least GROW_BATCH average requests, but never grow
+	   a small heap by more than a fraction of its size. */
+	if (asize >= grow_chunk)
+		return asize - tail;
+	chunk = MAX(grow_chunk, GROW_BATCH * avg_request);
+	chunk = MIN(chunk, MAX(CHUNKSIZE, mem_heapsize() / GROW_RATIO));
+	chunk = MIN(chunk, GROW_MAX);
+	return MAX(asize - tail, chunk);
+#else
+	return MAX(asize, CHUNKSIZE);
+#endif
+}
+
 /* 
  * place - Place block of asize bytes at start of free block bp 
  *         and split if remainder would be at least minimum block size
@@ -424,10 +1240,12 @@ static void place(void *bp, size_t asize)
 {
     size_t csize = GET_SIZE(HDRP(bp));   
 
-    if ((csize - asize) >= (DSIZE + OVERHEAD)) { 
+	/* The block must leave its free list while its header still
+	   holds the size the list was chosen by */
+	removeBlock(bp);
+    if ((csize - asize) >= SPLIT_MIN) { 
         PUT(HDRP(bp), PACK(asize, 1));
         PUT(FTRP(bp), PACK(asize, 1));
-		removeBlock(bp);
         bp = NEXT_BLKP(bp);
         PUT(HDRP(bp), PACK(csize-asize, 0));
         PUT(FTRP(bp), PACK(csize-asize, 0));
@@ -436,27 +1254,112 @@ static void place(void *bp, size_t asize)
     else { 
         PUT(HDRP(bp), PACK(csize, 1));
         PUT(FTRP(bp), PACK(csize, 1));
-		removeBlock(bp);
     }
 }
 /* $end mmplace */
 
+/*
+ * findAlignedFit - Find a free block that holds a block of asize bytes
+ * at its first cache line aligned address, see alignLead
+ */
+static void *findAlignedFit(size_t asize)
+{
+	int c;
+	
+	for (c = sizeClass(asize); c < NUM_CLASSES; c++) {
+		blockPtr *p = TO_PTR(roots->free_off[c]);
+		
+		for (; p != NULL; p = NEXT_FREE(p)) {
+			if (GET_SIZE(HDRP(p)) >= asize + alignLead((char *)p))
+				return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * alignLead - Return how far the free block bp has to be moved up for
+ * its payload to start on a cache line. What is left in front must make
+ * a free block of its own, so the distance is 0 or at least MIN_BLOCK.
+ */
+static size_t alignLead(char *bp)
+{
+	size_t lead = (LINE_SIZE - ((size_t)bp & (LINE_SIZE - 1))) & (LINE_SIZE - 1);
+	
+	if (lead > 0 && lead < MIN_BLOCK)
+		lead += LINE_SIZE;
+	return lead;
+}
+
 /* 
- * find_fit - Find a fit for a block with asize bytes 
+ * find_fit - Find a fit for a block with asize bytes. Starts with the
+ * size class of asize and moves on to larger classes until a fit is found.
  */
 static void *find_fit(size_t asize)
 {
-    /* first fit search */
-    blockPtr *p = (blockPtr *)free_listp;
+	int c;
 	
-    for (; p != NULL; p = p->next) {
-        if (!GET_ALLOC(HDRP(p)) && (asize <= GET_SIZE(HDRP(p)))) {
-            return (void *)p;
-        }
-    }
+	for (c = sizeClass(asize); c < NUM_CLASSES; c++) {
+		blockPtr *p = TO_PTR(roots->free_off[c]);
+#if SIZE_HINTS
+		/* Only the first block's size is read from its header, the
+		   rest come from the hint in the block before it. */
+		size_t size = p ? GET_SIZE(HDRP(p)) : 0;
+#define NEXT_FIT(p) (size = (p)->nextsize, (p) = NEXT_FREE(p))
+#else
+		size_t size;
+#define NEXT_FIT(p) ((p) = NEXT_FREE(p))
+#endif
+#if FIT == FIT_FIRST
+		/* first fit search */
+		for (; p != NULL; NEXT_FIT(p)) {
+			PREFETCH(HDRP(NEXT_FREE(p)));
+#if !SIZE_HINTS
+			size = GET_SIZE(HDRP(p));
+#endif
+			if (asize <= size) {
+				return (void *)p;
+			}
+		}
+#else
+		/* best fit search, stops early on an exact fit */
+		blockPtr *best = NULL;
+		size_t bestsize = 0;
+		
+		for (; p != NULL; NEXT_FIT(p)) {
+			PREFETCH(HDRP(NEXT_FREE(p)));
+#if !SIZE_HINTS
+			size = GET_SIZE(HDRP(p));
+#endif
+			if (asize <= size && (best == NULL || size < bestsize)) {
+				best = p;
+				bestsize = size;
+				if (size == asize)
+					break;
+			}
+		}
+		if (best != NULL)
+			return (void *)best;
+#endif
+#undef NEXT_FIT
+	}
     return NULL; /* no fit */
 }
 
+/*
+ * sizeClass - Return the index of the free list that holds blocks of
+ * the given size. The class limits are constants, so the loop is unrolled
+ * into a sum of comparisons and needs no branches.
+ */
+static int sizeClass(size_t size)
+{
+	int i, c = 0;
+	
+	for (i = 0; i < NUM_CLASSES - 1; i++)
+		c += (size > class_limits[i]);
+	return c;
+}
+
 /*
  * coalesce - boundary tag coalescing. Return ptr to coalesced block
  */
@@ -507,67 +1410,87 @@ static void *coalesce(void *bp)
 
 /* 
  *  Function that takes a block and inserts it at the
- *  front of the free list.
+ *  front of the free list of its size class.
  */
 static void insertBlock(void *bp)
 {
+	unsigned *free_listp = &roots->free_off[sizeClass(GET_SIZE(HDRP(bp)))];
+	
 	/* If the free list is empty we initialize it by having it point 
 	   to the block and setting prev and next to NULL. */
-	if(free_listp == NULL)
+	if(*free_listp == 0)
 	{
-		free_listp = bp;
-		blockPtr *p = (blockPtr *)free_listp;
-		p->prev = NULL;
-		p->next = NULL;
+		*free_listp = TO_OFF(bp);
+		blockPtr *p = bp;
+		p->prev = 0;
+		p->next = 0;
+#if SIZE_HINTS
+		p->nextsize = 0;
+#endif
 	}
 	/* Inserts bp at the front of the list and updates free_listp. */
 	else
 	{
-		blockPtr *p = (blockPtr *)free_listp;
-		p->prev = bp; 
+		blockPtr *p = TO_PTR(*free_listp);
+		p->prev = TO_OFF(bp); 
 		blockPtr *p2 = bp;
-		p2->prev = NULL;
-		p2->next = p;
-		free_listp = (char *)p2;
+		p2->prev = 0;
+		p2->next = *free_listp;
+#if SIZE_HINTS
+		p2->nextsize = GET_SIZE(HDRP(p));
+#endif
+		*free_listp = TO_OFF(p2);
 	}
 }
 
-/* Function that removes a block from the free list */
+/* 
+ * Function that removes a block from the free list. The header of the
+ * block must still hold the size it was inserted with.
+ */
 static void removeBlock(void *bp)
 {
+	unsigned *free_listp = &roots->free_off[sizeClass(GET_SIZE(HDRP(bp)))];
 	blockPtr *p = bp;
-	if(p->next != NULL)
+	if(p->next != 0)
 	{
-		p->next->prev = p->prev;
+		NEXT_FREE(p)->prev = p->prev;
 	}
-	if(p->prev != NULL)
+	if(p->prev != 0)
 	{
-		p->prev->next = p->next;
+		PREV_FREE(p)->next = p->next;
+#if SIZE_HINTS
+		PREV_FREE(p)->nextsize = p->nextsize;
+#endif
 	}
 	/* If prev is NULL that means the bp is at the front 
 	   of the list so we must update free_listp. */ 
 	else
 	{
-		free_listp = (char *)p->next;
-		if(p->next != NULL)
+		*free_listp = p->next;
+		if(p->next != 0)
 		{
-			p->next->prev = NULL;
+			NEXT_FREE(p)->prev = 0;
 		}
 	}
 }
 
 /* 
- *  Function to help with debugging. Goes through the free list 
- *  and prints every block in the free list.
+ *  Function to help with debugging. Goes through the free lists 
+ *  and prints every block in the free lists.
  */
 void printfreelist()
 {
-	blockPtr *p = (blockPtr *)free_listp;
+	int c;
 	
-    for (; p != NULL; p = p->next) 
+	for (c = 0; c < NUM_CLASSES; c++)
 	{
-		printblock((void *)p);
-    } 
+		blockPtr *p = TO_PTR(roots->free_off[c]);
+		
+		for (; p != NULL; p = NEXT_FREE(p)) 
+		{
+			printblock((void *)p);
+		} 
+	}
 }
 
 /* 
@@ -576,31 +1499,34 @@ void printfreelist()
  */
 static void checkfreeblock(blockPtr *p)
 {
-	if(p->prev != NULL) 
+	blockPtr *prev = PREV_FREE(p);
+	blockPtr *next = NEXT_FREE(p);
+	
+	if(prev != NULL) 
 	{
 		/* Check if prev points to a block within heap bounds */
-		if(p->prev < (blockPtr *)mem_heap_lo() || p->prev  > (blockPtr *)mem_heap_hi())
+		if(prev < (blockPtr *)mem_heap_lo() || prev  > (blockPtr *)mem_heap_hi())
 		{
-			printf("Error: pointer %p is not within heap bounds \n", p->prev);
+			CHECK_ERROR("Error: pointer %p is not within heap bounds \n", prev);
 		}
 		/* Check if prev points to a free block */
-		if(GET_ALLOC(HDRP(p->prev)))
+		else if(GET_ALLOC(HDRP(prev)))
 		{
-			printf("Error: pointer %p points to an allocated block \n", p->prev);
+			CHECK_ERROR("Error: pointer %p points to an allocated block \n", prev);
 		}
 	}	
 	
-	if(p->next != NULL )
+	if(next != NULL )
 	{
 		/* Check if next points to a block within heap bounds */
-		if(p->next < (blockPtr *)mem_heap_lo() || p->next  > (blockPtr *)mem_heap_hi())
+		if(next < (blockPtr *)mem_heap_lo() || next  > (blockPtr *)mem_heap_hi())
 		{
-			printf("Error: pointer %p is not within heap bounds \n", p->next);
+			CHECK_ERROR("Error: pointer %p is not within heap bounds \n", next);
 		}
 		/* Check if next points to a free block */
-		if(GET_ALLOC(HDRP(p->next)))
+		else if(GET_ALLOC(HDRP(next)))
 		{
-			printf("Error: pointer %p points to an allocated block \n", p->next);
+			CHECK_ERROR("Error: pointer %p points to an allocated block \n", next);
 		}
 	}
 }
@@ -627,34 +1553,35 @@ static void printblock(void *bp)
 
 /* 
  * Checks if a block is aligned correctly and has a matching header and footer.
- * Checks for contiguous free blocks. Checks if a free block is in the free list. 
+ * Checks for contiguous free blocks. Unless fast is set, checks if a free
+ * block is in the free list. 
  */
-static void checkblock(void *bp) 
+static void checkblock(void *bp, int fast) 
 {
     if ((size_t)bp % 8)
-        printf("Error: %p is not doubleword aligned\n", bp);
+        CHECK_ERROR("Error: %p is not doubleword aligned\n", bp);
     if (GET(HDRP(bp)) != GET(FTRP(bp)))
-        printf("Error: header does not match footer\n");
+        CHECK_ERROR("Error: header does not match footer\n");
 	if(!GET_ALLOC(HDRP(bp)))
 	{
 		if(!GET_ALLOC(HDRP(PREV_BLKP(bp))) || !GET_ALLOC(HDRP(NEXT_BLKP(bp))))
 		{
-			printf("Error: contiguous free blocks next to %p\n", bp);
+			CHECK_ERROR("Error: contiguous free blocks next to %p\n", bp);
 		}
 		
-		if(!inFreelist(bp))
+		if(!fast && !inFreelist(bp))
 		{
-			printf("Error: free block at %p is not in free list\n", bp);
+			CHECK_ERROR("Error: free block at %p is not in free list\n", bp);
 		}
 	}
 }
 
-/* Checks if a block is in the free list or not */
+/* Checks if a block is in the free list of its size class or not */
 static int inFreelist(void *bp)
 {
-	blockPtr *p = (blockPtr *)free_listp;
+	blockPtr *p = TO_PTR(roots->free_off[sizeClass(GET_SIZE(HDRP(bp)))]);
 	
-    for (; p != NULL; p = p->next) 
+    for (; p != NULL; p = NEXT_FREE(p)) 
 	{
 		if(p == bp)
 		{
@@ -662,4 +1589,303 @@ static int inFreelist(void *bp)
 		}
     } 
 	return 0;
-}
\ No newline at end of file
+}
+
+#if BG_COALESCE
+/*
+ * startHelper - Start the helper thread, called once from mm_init
+ */
+static void startHelper(void)
+{
+	pthread_t tid;
+	
+	if (pthread_create(&tid, NULL, helper, NULL) != 0) {
+		printf("ERROR: could not start the coalescing thread\n");
+		exit(1);
+	}
+	pthread_detach(tid);
+}
+
+/*
+ * helper - Body of the helper thread. Wakes up every TRIM_IDLE
+ * microseconds, sorts the queue without holding the heap lock and frees
+ * the blocks FREE_BATCH at a time, so that mm_malloc waits for one batch
+ * at most. The first time it finds the queue empty it trims the heap
+ * tail and then sleeps until mm_free wakes it. Waking it on every free
+ * would put a context switch into mm_free.
+ */
+static void *helper(void *arg)
+{
+	struct timespec until;
+	
+	for (;;) {
+		pthread_mutex_lock(&helper_lock);
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += TRIM_IDLE * 1000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		while (pthread_cond_timedwait(&helper_wake, &helper_lock, &until) 
+			   != ETIMEDOUT)
+			;
+		if (free_queue == NULL) {
+			pthread_mutex_unlock(&helper_lock);
+			LOCK();
+			if (ownHeap())
+				trimTail();
+			UNLOCK();
+			pthread_mutex_lock(&helper_lock);
+			helper_parked = 1;
+			__sync_synchronize(); /* mm_free pushes, then reads helper_parked */
+			while (free_queue == NULL)
+				pthread_cond_wait(&helper_wake, &helper_lock);
+			helper_parked = 0;
+		}
+		pthread_mutex_unlock(&helper_lock);
+		sortFreeQueue();
+		while (freeBatch())
+			;
+	}
+	return NULL;
+}
+
+/*
+ * ownHeap - Check that the memory system still holds the heap that
+ * mm_init built, i.e. mm_deinit has not been called and the brk has not
+ * been reset since. Otherwise the queued blocks and the tail are not
+ * ours to touch.
+ */
+static int ownHeap(void)
+{
+	return heap_base != NULL && heap_base == mem_heap_lo() 
+		&& mem_heapsize() > ROOTS_SIZE;
+}
+
+/*
+ * drainFreeQueue - Take every block off the free queue, sort them by
+ * address and free them in that order, together with the blocks the
+ * helper has sorted but not freed yet, so that neighbouring blocks are
+ * merged while they are still close in the cache. Returns the number
+ * of blocks freed. The caller holds the heap lock.
+ */
+static int drainFreeQueue(void)
+{
+	char *bp, *sorted = sortQueue(__sync_lock_test_and_set(&free_queue, NULL));
+	int n = 0;
+	
+	sorted = mergeQueues(free_sorted, sorted);
+	free_sorted = NULL;
+	for (bp = sorted; bp != NULL; bp = sorted) {
+		sorted = *(char **)bp;
+		freeBlock(bp);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * sortFreeQueue - Take every block off the free queue and sort them by
+ * address without holding the heap lock, then add them to free_sorted
+ * for freeBatch. mm_deinit waits on sort_lock until they are there.
+ */
+static void sortFreeQueue(void)
+{
+	char *sorted;
+	
+	pthread_mutex_lock(&sort_lock);
+	sorted = sortQueue(__sync_lock_test_and_set(&free_queue, NULL));
+	LOCK();
+	if (ownHeap())
+		free_sorted = mergeQueues(free_sorted, sorted);
+	UNLOCK();
+	pthread_mutex_unlock(&sort_lock);
+}
+
+/*
+ * freeBatch - Free up to FREE_BATCH blocks of free_sorted under the
+ * heap lock. Returns nonzero while blocks are left.
+ */
+static int freeBatch(void)
+{
+	char *bp;
+	int n, left;
+	
+	LOCK();
+	if (!ownHeap())
+		free_sorted = NULL;
+	for (n = 0; n < FREE_BATCH && (bp = free_sorted) != NULL; n++) {
+		free_sorted = *(char **)bp;
+		freeBlock(bp);
+	}
+	left = free_sorted != NULL;
+	UNLOCK();
+	return left;
+}
+
+/*
+ * sortQueue - Sort a list of queued blocks by address. Runs of 1, 2,
+ * 4, ... blocks are merged bottom up, so that the long queue a burst of
+ * frees leaves behind costs n log n rather than n^2.
+ */
+static char *sortQueue(char *list)
+{
+	char *runs[8 * sizeof(void *)]; /* runs[k] is 2^k blocks or NULL */
+	char *run;
+	int k, top = 0;
+	
+	while (list != NULL) {
+		run = list;
+		list = *(char **)list;
+		*(char **)run = NULL;
+		for (k = 0; k < top && runs[k] != NULL; k++) {
+			run = mergeQueues(runs[k], run);
+			runs[k] = NULL;
+		}
+		if (k == top)
+			top++;
+		runs[k] = run;
+	}
+	for (run = NULL, k = 0; k < top; k++)
+		if (runs[k] != NULL)
+			run = mergeQueues(runs[k], run);
+	return run;
+}
+
+/*
+ * mergeQueues - Merge two lists of queued blocks sorted by address
+ */
+static char *mergeQueues(char *a, char *b)
+{
+	char *head = NULL;
+	char **tail = &head;
+	
+	while (a != NULL && b != NULL) {
+		if (a < b) {
+			*tail = a;
+			a = *(char **)a;
+		} else {
+			*tail = b;
+			b = *(char **)b;
+		}
+		tail = (char **)*tail;
+	}
+	*tail = a != NULL ? a : b;
+	return head;
+}
+
+/*
+ * trimTail - If the last block on the heap is free and at least
+ * TRIM_THRESHOLD bytes, give the pages inside it back to the OS. The
+ * block stays on its free list; only its header, footer and list links
+ * must survive. The caller holds the heap lock.
+ */
+static void trimTail(void)
+{
+	char *bp;
+	size_t size;
+	
+	bp = PREV_BLKP((char *)mem_heap_hi() + 1);
+	size = GET_SIZE(HDRP(bp));
+	if (GET_ALLOC(HDRP(bp)) || size < TRIM_THRESHOLD 
+		|| (bp == trimmed_tail && size == trimmed_size))
+		return;
+	mem_release(bp + sizeof(blockPtr), size - sizeof(blockPtr) - DSIZE);
+	trimmed_tail = bp;
+	trimmed_size = size;
+}
+#endif
+
+/*
+ * profSample - Record the allocation of bp and draw the number of bytes
+ * until the next sample from an exponential distribution, so that the
+ * samples do not line up with a periodic allocation pattern. Also
+ * called when the countdown runs out with the sampler off, which only
+ * rearms it.
+ */
+static void profSample(void *bp, size_t size)
+{
+	double u;
+	
+	if (prof_interval == 0) {
+		prof_countdown = LONG_MAX;
+		return;
+	}
+	/* xorshift64*, not rand(), which would move the program's sequence */
+	prof_rng ^= prof_rng >> 12;
+	prof_rng ^= prof_rng << 25;
+	prof_rng ^= prof_rng >> 27;
+	u = (((prof_rng * 0x2545f4914f6cdd1dULL) >> 11) + 1.0) 
+		/ 9007199254740992.0;
+	prof_countdown = (long)(-log(u) * prof_interval);
+	profRecord(bp, size);
+}
+
+/*
+ * profRecord - Take the backtrace of an allocation of bp and mark the
+ * block as sampled
+ */
+static void profRecord(void *bp, size_t size)
+{
+	profrec_t *r;
+	size_t h = ((size_t)bp >> 3) % PROF_BUCKETS;
+	
+	if ((r = malloc(sizeof(profrec_t))) == NULL)
+		return;
+	r->bp = bp;
+	r->size = size;
+	r->depth = backtrace(r->stack, PROF_DEPTH);
+	r->next = prof_table[h];
+	prof_table[h] = r;
+	PUT(HDRP(bp), GET(HDRP(bp)) | SAMPLED);
+	PUT(FTRP(bp), GET(FTRP(bp)) | SAMPLED);
+}
+
+/*
+ * profForget - Drop the record of a sampled block and clear its mark
+ */
+static void profForget(void *bp)
+{
+	profrec_t **pp;
+	profrec_t *r;
+	
+	for (pp = &prof_table[((size_t)bp >> 3) % PROF_BUCKETS]; *pp != NULL; 
+		pp = &(*pp)->next) {
+		if ((*pp)->bp == bp) {
+			r = *pp;
+			*pp = r->next;
+			free(r);
+			break;
+		}
+	}
+	PUT(HDRP(bp), GET(HDRP(bp)) & ~SAMPLED);
+	PUT(FTRP(bp), GET(FTRP(bp)) & ~SAMPLED);
+}
+
+/*
+ * profClear - Drop every record
+ */
+static void profClear(void)
+{
+	profrec_t *r, *next;
+	int i;
+	
+	for (i = 0; i < PROF_BUCKETS; i++) {
+		for (r = prof_table[i]; r != NULL; r = next) {
+			next = r->next;
+			free(r);
+		}
+		prof_table[i] = NULL;
+	}
+}
+
+/*
+ * profCompare - qsort order of records, by stack
+ */
+static int profCompare(const void *a, const void *b)
+{
+	const profrec_t *ra = *(const profrec_t **)a;
+	const profrec_t *rb = *(const profrec_t **)b;
+	
+	if (ra->depth != rb->depth)
+		return ra->depth - rb->depth;
+	return memcmp(ra->stack, rb->stack, ra->depth * sizeof(void *));
+}
@@ -2,8 +2,73 @@
 
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
+extern void *mm_malloc_flags(size_t size, int flags);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void mm_deinit(void);
+
+/*
+ * A snapshot of the heap, for tools that compare allocators or watch
+ * fragmentation. mm_heapstats walks the whole heap, so it takes time
+ * linear in the number of blocks.
+ */
+typedef struct {
+    size_t heap_bytes;    /* bytes of heap the allocator holds */
+    size_t free_bytes;    /* bytes of it in free blocks */
+    size_t free_blocks;   /* number of free blocks */
+    size_t largest_free;  /* size of the largest free block */
+} mm_heapstats_t;
+
+extern void mm_heapstats(mm_heapstats_t *hs);
+
+/*
+ * Flags for mm_malloc_flags. MM_ALIGN_LINE gives the block cache lines
+ * of its own, so that blocks used by different threads do not falsely
+ * share a line. mm_realloc does not keep the alignment when it moves
+ * the block.
+ */
+#define MM_ALIGN_LINE 0x1
+
+/*
+ * Warm restart: mm_attach picks up a heap that mm_init built in an
+ * earlier process (see mem_init_file), mm_set_root and mm_get_root keep
+ * one block of the application in the heap so it can find its data.
+ */
+extern int mm_attach(void);
+extern void mm_set_root(void *bp);
+extern void *mm_get_root(void);
+
+/* 
+ * Sampling heap profiler: mm_prof_start samples about one allocation 
+ * per interval bytes, mm_prof_dump writes a pprof heap profile of the 
+ * sampled blocks that are still live.
+ */
+extern void mm_prof_start(size_t interval);
+extern void mm_prof_stop(void);
+extern void mm_prof_dump(FILE *fp);
+
+/*
+ * Declares the entry points of an extra instantiation of mm.c that
+ * was compiled with -DMM_PREFIX=p (see mm-policy.h)
+ */
+#define MM_DECLARE_POLICY(p) \
+    extern int p##_init(void); \
+    extern void *p##_malloc(size_t size); \
+    extern void *p##_malloc_flags(size_t size, int flags); \
+    extern void p##_free(void *ptr); \
+    extern void *p##_realloc(void *ptr, size_t size); \
+    extern void p##_deinit(void); \
+    extern void p##_heapstats(mm_heapstats_t *hs)
+
+MM_DECLARE_POLICY(mm_seg);
+MM_DECLARE_POLICY(mm_best);
+MM_DECLARE_POLICY(mm_pf);
+MM_DECLARE_POLICY(mm_bg);
+MM_DECLARE_POLICY(mm_adapt);
+MM_DECLARE_POLICY(mm_segmt);
+
+/* The implicit list baseline in mm-firstfit.c, built with -DMM_PREFIX=mm_ff */
+MM_DECLARE_POLICY(mm_ff);
 
 
 /* 
@@ -0,0 +1,374 @@
+/*
+ * mmbench.c - Time single allocator paths, one size class at a time.
+ *
+ * Traces mix every path of the allocator, so when a trace gets slower
+ * they do not say which one. Each benchmark here runs one pattern of
+ * requests at one size against mm.c (the default policy) and against
+ * libc malloc:
+ *
+ *   pair      malloc and free the same block, over and over
+ *   lifo      malloc a batch of blocks, free them newest first
+ *   fifo      malloc a batch of blocks, free them oldest first
+ *   rand      malloc a batch of blocks, free them in a shuffled order
+ *   grow      grow a block with realloc, size bytes at a time
+ *   calloc    calloc and free the same block
+ *   memalign  cache line aligned malloc and free the same block
+ *
+ * mm.c has neither calloc nor memalign: calloc is mm_malloc followed
+ * by memset, as a libc on top of mm.c would do it, and memalign is
+ * mm_malloc_flags with MM_ALIGN_LINE, the only alignment it offers.
+ *
+ * Every benchmark runs some warmup repetitions, then timed ones, and
+ * reports the mean time per request with a 95% confidence interval
+ * over the repetitions, and the fastest repetition. A request is one
+ * malloc, free or realloc.
+ *
+ * usage: mmbench [-b <bench>] [-s <size>] [-n <reps>] [-w <warmups>]
+ *                [-o <ops>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "mm-policy.h"
+#include "mm.h"
+#include "memlib.h"
+#include "tdist.h"
+
+#define MAXREPS   1000
+#define MAXBATCH  1024            /* blocks live at once in lifo/fifo/rand */
+#define BATCH_MEM (4 * (1 << 20)) /* and most bytes they take */
+#define GROW_STEPS 64             /* reallocs a grow block goes through */
+#define LINE      64              /* alignment of memalign */
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+
+/* An allocator under test */
+typedef struct {
+    char *name;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*memalign)(size_t size);     /* aligned to LINE */
+} bench_impl_t;
+
+static int libc_init(void);
+static void *mm_calloc(size_t nmemb, size_t size);
+static void *mm_memalign(size_t size);
+static void *libc_memalign(size_t size);
+
+static bench_impl_t impls[] = {
+    {"mm", mm_init, mm_malloc, mm_free, mm_realloc, mm_calloc, mm_memalign},
+    {"libc", libc_init, malloc, free, realloc, calloc, libc_memalign},
+};
+#define NUM_IMPLS (sizeof(impls) / sizeof(bench_impl_t))
+
+/* A benchmark: run returns the number of requests it made */
+typedef struct {
+    char *name;
+    long (*run)(bench_impl_t *impl, size_t size);
+} bench_t;
+
+static long run_pair(bench_impl_t *impl, size_t size);
+static long run_lifo(bench_impl_t *impl, size_t size);
+static long run_fifo(bench_impl_t *impl, size_t size);
+static long run_rand(bench_impl_t *impl, size_t size);
+static long run_grow(bench_impl_t *impl, size_t size);
+static long run_calloc(bench_impl_t *impl, size_t size);
+static long run_memalign(bench_impl_t *impl, size_t size);
+
+static bench_t benches[] = {
+    {"pair", run_pair},
+    {"lifo", run_lifo},
+    {"fifo", run_fifo},
+    {"rand", run_rand},
+    {"grow", run_grow},
+    {"calloc", run_calloc},
+    {"memalign", run_memalign},
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(bench_t))
+
+/* The size classes, powers of two from 16 bytes to 16 KB */
+static size_t sizes[] = {16, 64, 256, 1024, 4096, 16384};
+#define NUM_SIZES (sizeof(sizes) / sizeof(size_t))
+
+static long num_ops = 100000;   /* requests per repetition, about */
+static void *blocks[MAXBATCH];
+static int order[MAXBATCH];     /* the shuffled free order of rand */
+static volatile long sink;
+
+static void bench(bench_t *b, bench_impl_t *impl, size_t size, int reps,
+		  int warmups);
+static long run_batch(bench_impl_t *impl, size_t size, int how);
+static double now(void);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    char *only_bench = NULL;
+    size_t only_size = 0;
+    int reps = 10, warmups = 2;
+    int c, b, s, i, found = 0;
+
+    while ((c = getopt(argc, argv, "b:s:n:w:o:h")) != EOF) {
+	switch (c) {
+	case 'b':
+	    only_bench = optarg;
+	    break;
+	case 's':
+	    only_size = atol(optarg);
+	    break;
+	case 'n':
+	    reps = atoi(optarg);
+	    break;
+	case 'w':
+	    warmups = atoi(optarg);
+	    break;
+	case 'o':
+	    num_ops = atol(optarg);
+	    break;
+	case 'h':
+	default:
+	    usage();
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (reps < 2 || reps > MAXREPS || warmups < 0 || num_ops < 1 ||
+	optind < argc) {
+	usage();
+	exit(1);
+    }
+
+    /* A fixed shuffle, so every allocator frees in the same order */
+    srand(1);
+    for (i = 0; i < MAXBATCH; i++)
+	order[i] = i;
+    for (i = MAXBATCH - 1; i > 0; i--) {
+	int j = rand() % (i + 1), t = order[i];
+
+	order[i] = order[j];
+	order[j] = t;
+    }
+
+    mem_init();
+    printf("%d warmup and %d timed repetitions of about %ld requests\n\n",
+	   warmups, reps, num_ops);
+    printf("%-9s %6s %-5s %10s %9s %10s\n", "bench", "size", "alloc",
+	   "ns/req", "+-95%", "min ns");
+    for (b = 0; b < NUM_BENCHES; b++) {
+	if (only_bench != NULL && strcmp(only_bench, benches[b].name))
+	    continue;
+	for (s = 0; s < NUM_SIZES; s++) {
+	    if (only_size != 0 && only_size != sizes[s])
+		continue;
+	    found = 1;
+	    for (i = 0; i < NUM_IMPLS; i++)
+		bench(&benches[b], &impls[i], sizes[s], reps, warmups);
+	}
+    }
+    mem_deinit();
+    if (!found) {
+	fprintf(stderr, "mmbench: no benchmark matches\n");
+	exit(1);
+    }
+    exit(0);
+}
+
+/*
+ * bench - Run b against impl on a fresh heap and print a line of
+ *     results
+ */
+static void bench(bench_t *b, bench_impl_t *impl, size_t size, int reps,
+		  int warmups)
+{
+    double ns[MAXREPS], t, mean = 0, var = 0, min = 0;
+    long ops;
+    int r;
+
+    mem_reset_brk();
+    if (impl->init() < 0) {
+	fprintf(stderr, "mmbench: %s init failed\n", impl->name);
+	exit(1);
+    }
+    for (r = 0; r < warmups; r++)
+	b->run(impl, size);
+    for (r = 0; r < reps; r++) {
+	t = now();
+	ops = b->run(impl, size);
+	ns[r] = (now() - t) * 1e9 / ops;
+	mean += ns[r];
+	if (r == 0 || ns[r] < min)
+	    min = ns[r];
+    }
+    mean /= reps;
+    for (r = 0; r < reps; r++)
+	var += (ns[r] - mean) * (ns[r] - mean);
+    var /= reps - 1;
+
+    printf("%-9s %6lu %-5s %10.1f %9.1f %10.1f\n", b->name,
+	   (unsigned long)size, impl->name, mean,
+	   t_975(reps - 1) * sqrt(var / reps), min);
+}
+
+static long run_pair(bench_impl_t *impl, size_t size)
+{
+    long i;
+    char *p;
+
+    for (i = 0; i < num_ops / 2; i++) {
+	p = impl->malloc(size);
+	p[0] = 1;
+	impl->free(p);
+    }
+    return i * 2;
+}
+
+static long run_lifo(bench_impl_t *impl, size_t size)
+{
+    return run_batch(impl, size, 'l');
+}
+
+static long run_fifo(bench_impl_t *impl, size_t size)
+{
+    return run_batch(impl, size, 'f');
+}
+
+static long run_rand(bench_impl_t *impl, size_t size)
+{
+    return run_batch(impl, size, 'r');
+}
+
+/*
+ * run_batch - Allocate a batch of blocks and free them in the order
+ *     how says: 'l' newest first, 'f' oldest first, 'r' shuffled. The
+ *     batch is kept small enough for the blocks to fit the heap.
+ */
+static long run_batch(bench_impl_t *impl, size_t size, int how)
+{
+    int n = MIN(MAXBATCH, BATCH_MEM / size), i;
+    long ops = 0;
+
+    while (ops < num_ops) {
+	for (i = 0; i < n; i++) {
+	    blocks[i] = impl->malloc(size);
+	    *(char *)blocks[i] = 1;
+	}
+	if (how == 'r') {
+	    /* The shuffle of MAXBATCH, less the ids the batch lacks */
+	    for (i = 0; i < MAXBATCH; i++)
+		if (order[i] < n)
+		    impl->free(blocks[order[i]]);
+	}
+	else
+	    for (i = 0; i < n; i++)
+		impl->free(blocks[how == 'l' ? n - 1 - i : i]);
+	ops += 2 * n;
+    }
+    return ops;
+}
+
+/*
+ * run_grow - Grow blocks from size bytes by size bytes at a time, as a
+ *     buffer that is appended to does
+ */
+static long run_grow(bench_impl_t *impl, size_t size)
+{
+    long ops = 0;
+    char *p;
+    int i;
+
+    while (ops < num_ops) {
+	p = impl->malloc(size);
+	for (i = 2; i <= GROW_STEPS; i++) {
+	    p = impl->realloc(p, i * size);
+	    p[i * size - 1] = 1;
+	}
+	impl->free(p);
+	ops += GROW_STEPS + 1;
+    }
+    return ops;
+}
+
+static long run_calloc(bench_impl_t *impl, size_t size)
+{
+    long i;
+    char *p;
+
+    for (i = 0; i < num_ops / 2; i++) {
+	p = impl->calloc(1, size);
+	sink += p[size - 1];
+	impl->free(p);
+    }
+    return i * 2;
+}
+
+static long run_memalign(bench_impl_t *impl, size_t size)
+{
+    long i;
+    char *p;
+
+    for (i = 0; i < num_ops / 2; i++) {
+	p = impl->memalign(size);
+	p[0] = 1;
+	impl->free(p);
+    }
+    return i * 2;
+}
+
+/* libc needs no heap reset, and mm.c lacks calloc and memalign */
+static int libc_init(void)
+{
+    return 0;
+}
+
+static void *mm_calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size != 0 && nmemb > (size_t)-1 / size)
+	return NULL;
+    if ((p = mm_malloc(nmemb * size)) != NULL)
+	memset(p, 0, nmemb * size);
+    return p;
+}
+
+static void *mm_memalign(size_t size)
+{
+    return mm_malloc_flags(size, MM_ALIGN_LINE);
+}
+
+static void *libc_memalign(size_t size)
+{
+    void *p;
+
+    return posix_memalign(&p, LINE, size) == 0 ? p : NULL;
+}
+
+/*
+ * now - wall clock time in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmbench [-b <bench>] [-s <size>] [-n <reps>] [-w <warmups>]\n");
+    fprintf(stderr, "               [-o <ops>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <bench>  Run only <bench> (pair, lifo, fifo, rand, grow,\n");
+    fprintf(stderr, "\t            calloc or memalign).\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "\t-n <reps>   Timed repetitions (default 10, at least 2).\n");
+    fprintf(stderr, "\t-o <ops>    Requests per repetition (default 100000).\n");
+    fprintf(stderr, "\t-s <size>   Run only size class <size> (16 to 16384).\n");
+    fprintf(stderr, "\t-w <n>      Untimed warmup repetitions (default 2).\n");
+}
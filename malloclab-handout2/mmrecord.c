@@ -0,0 +1,387 @@
+/*
+ * mmrecord.c - Record the allocator calls of a running process
+ *
+ * Built as libmmrecord.so ("make libmmrecord.so") and loaded into a
+ * process with LD_PRELOAD:
+ *
+ *   unix> LD_PRELOAD=./libmmrecord.so MMRECORD_PREFIX=/tmp/svc svc ...
+ *   unix> recmerge -o svc.rep /tmp/svc.<pid>.*
+ *
+ * malloc, calloc, realloc, free and the aligned allocators are passed
+ * on to the next library (normally libc) and logged in the format of
+ * mmrecord.h. The prefix defaults to "mmrec" in the current directory.
+ *
+ * Every thread logs into a buffer of its own and writes it to a file
+ * of its own when the buffer fills, when the thread exits and when the
+ * process exits, so threads never wait for each other. The only thing
+ * they share is the counter that orders the calls, which is taken with
+ * an atomic add. A free takes its number before the block is released
+ * and an allocation after it has got its block, so a block handed out
+ * again always shows up freed before it is allocated again. A realloc
+ * takes its number first too; recmerge sorts out the rare case where
+ * it then moves onto a block another thread was just freeing.
+ *
+ * Calls the recorder makes itself, and calls from the dynamic linker
+ * while the real functions are being looked up, are not logged.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "mmrecord.h"
+
+#define REC_BUF   4096      /* records a thread buffers before writing */
+#define BOOT_SIZE 4096      /* bytes for dlsym while we look up calloc */
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* A thread's log. Buffers are never unmapped, a thread that exits
+   leaves its buffer to the next thread that starts. */
+typedef struct rbuf {
+    struct rbuf *next;          /* all buffers made */
+    volatile int in_use;        /* does a thread own it? */
+    int fd;                     /* log file, -1 if it could not be made */
+    int n;                      /* records buffered */
+    uint32_t tid;
+    rec_t recs[REC_BUF];
+} rbuf_t;
+
+/* The functions we stand in for */
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+static char boot[BOOT_SIZE];    /* handed out while resolving */
+static size_t boot_used;
+static int resolving;
+
+static volatile int recording;  /* between our constructor and destructor */
+static volatile uint64_t next_seq;
+static volatile int num_files;
+static rbuf_t *volatile all_bufs;
+static pthread_key_t buf_key;
+static const char *prefix = "mmrec";
+
+static TLS rbuf_t *tbuf;        /* this thread's buffer */
+static TLS int busy;            /* inside the recorder? */
+
+static void resolve(void);
+static void record(int type, uint64_t seq, void *ptr, void *old, size_t size);
+static rbuf_t *get_buf(void);
+static void flush_buf(rbuf_t *b);
+static void put_buf(void *arg);
+
+/*
+ * take_seq - The next call number. Only calls that will be logged
+ *     take one, so the numbers in the logs have no gaps but the
+ *     merge does not depend on that.
+ */
+static inline uint64_t take_seq(void)
+{
+    return __sync_fetch_and_add(&next_seq, 1);
+}
+
+static inline int logging(void)
+{
+    return recording && !busy;
+}
+
+static inline int from_boot(void *p)
+{
+    return (char *)p >= boot && (char *)p < boot + BOOT_SIZE;
+}
+
+/*
+ * boot_alloc - Memory for dlsym, which may call calloc before we know
+ *     where the real one is. It is zeroed and never given back.
+ */
+static void *boot_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > BOOT_SIZE)
+	return NULL;
+    p = boot + boot_used;
+    boot_used += size;
+    return p;
+}
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (real_malloc == NULL) {
+	if (resolving)
+	    return boot_alloc(size);
+	resolve();
+    }
+    p = real_malloc(size);
+    if (p != NULL && logging())
+	record(REC_MALLOC, take_seq(), p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (real_calloc == NULL) {
+	if (resolving)
+	    return size && nmemb > (size_t)-1 / size ? NULL :
+		boot_alloc(nmemb * size);
+	resolve();
+    }
+    p = real_calloc(nmemb, size);
+    if (p != NULL && logging())
+	record(REC_MALLOC, take_seq(), p, NULL, nmemb * size);
+    return p;
+}
+
+void *realloc(void *old, size_t size)
+{
+    uint64_t seq = 0;
+    void *p;
+    int log;
+
+    if (real_realloc == NULL)
+	resolve();
+    if (from_boot(old)) {
+	/* Move it out of the boot area, whose sizes we do not keep */
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, old, size < (size_t)(boot + BOOT_SIZE - (char *)old) ?
+		   size : (size_t)(boot + BOOT_SIZE - (char *)old));
+	return p;
+    }
+    if ((log = logging()))
+	seq = take_seq();
+    p = real_realloc(old, size);
+    /* A failed realloc leaves the block as it was, unless size was 0 */
+    if (log && (p != NULL || (old != NULL && size == 0)))
+	record(REC_REALLOC, seq, p, old, size);
+    return p;
+}
+
+void free(void *p)
+{
+    if (p == NULL || from_boot(p))
+	return;
+    if (real_free == NULL)
+	resolve();
+    if (logging())
+	record(REC_FREE, take_seq(), p, NULL, 0);
+    real_free(p);
+}
+
+int posix_memalign(void **pp, size_t align, size_t size)
+{
+    int err;
+
+    if (real_posix_memalign == NULL)
+	resolve();
+    err = real_posix_memalign(pp, align, size);
+    if (err == 0 && logging())
+	record(REC_MALLOC, take_seq(), *pp, NULL, size);
+    return err;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    void *p;
+
+    if (real_aligned_alloc == NULL)
+	resolve();
+    p = real_aligned_alloc(align, size);
+    if (p != NULL && logging())
+	record(REC_MALLOC, take_seq(), p, NULL, size);
+    return p;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (real_memalign == NULL)
+	resolve();
+    p = real_memalign(align, size);
+    if (p != NULL && logging())
+	record(REC_MALLOC, take_seq(), p, NULL, size);
+    return p;
+}
+
+/*
+ * resolve - Look up the functions we stand in for
+ */
+static void resolve(void)
+{
+    resolving = 1;
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = 0;
+    if (real_malloc == NULL || real_calloc == NULL || real_realloc == NULL ||
+	real_free == NULL || real_posix_memalign == NULL ||
+	real_aligned_alloc == NULL || real_memalign == NULL) {
+	static const char msg[] = "mmrecord: no allocator to pass calls to\n";
+	write(2, msg, sizeof(msg) - 1);
+	_exit(127);
+    }
+}
+
+/*
+ * record - Append one call to this thread's log
+ */
+static void record(int type, uint64_t seq, void *ptr, void *old, size_t size)
+{
+    rec_t *r;
+
+    busy = 1;
+    if (tbuf == NULL)
+	tbuf = get_buf();
+    r = &tbuf->recs[tbuf->n++];
+    r->seq = seq;
+    r->ptr = (uintptr_t)ptr;
+    r->old = (uintptr_t)old;
+    r->size = size;
+    r->type = type;
+    r->tid = tbuf->tid;
+    if (tbuf->n == REC_BUF)
+	flush_buf(tbuf);
+    busy = 0;
+}
+
+/*
+ * get_buf - Take over the buffer of a thread that has exited, or make
+ *     a new one, and start a log file for it
+ */
+static rbuf_t *get_buf(void)
+{
+    char name[4096];
+    rbuf_t *b, *head;
+
+    for (b = all_bufs; b != NULL; b = b->next)
+	if (!b->in_use && __sync_bool_compare_and_swap(&b->in_use, 0, 1))
+	    break;
+    if (b == NULL) {
+	b = mmap(NULL, sizeof(rbuf_t), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b == MAP_FAILED) {
+	    static const char msg[] = "mmrecord: out of memory\n";
+	    write(2, msg, sizeof(msg) - 1);
+	    _exit(127);
+	}
+	b->in_use = 1;
+	do {
+	    head = all_bufs;
+	    b->next = head;
+	} while (!__sync_bool_compare_and_swap(&all_bufs, head, b));
+    }
+
+    b->n = 0;
+    b->tid = syscall(SYS_gettid);
+    snprintf(name, sizeof(name), "%s.%d.%d", prefix, (int)getpid(),
+	     __sync_fetch_and_add(&num_files, 1));
+    if ((b->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	static const char msg[] = "mmrecord: could not create a log file\n";
+	write(2, msg, sizeof(msg) - 1);
+    }
+    pthread_setspecific(buf_key, b);
+    return b;
+}
+
+/*
+ * flush_buf - Write out the records buffered in b
+ */
+static void flush_buf(rbuf_t *b)
+{
+    char *p = (char *)b->recs;
+    size_t left = b->n * sizeof(rec_t);
+    ssize_t n;
+
+    while (b->fd >= 0 && left > 0) {
+	if ((n = write(b->fd, p, left)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	p += n;
+	left -= n;
+    }
+    b->n = 0;
+}
+
+/*
+ * put_buf - Thread exit: write out the thread's log and leave its
+ *     buffer for the next thread
+ */
+static void put_buf(void *arg)
+{
+    rbuf_t *b = arg;
+
+    busy = 1;
+    flush_buf(b);
+    if (b->fd >= 0)
+	close(b->fd);
+    b->fd = -1;
+    tbuf = NULL;
+    __sync_synchronize();
+    b->in_use = 0;
+    busy = 0;
+}
+
+/*
+ * after_fork - The child's buffers hold the parent's records and its
+ *     files are the parent's logs, so it starts over with its own
+ */
+static void after_fork(void)
+{
+    all_bufs = NULL;
+    tbuf = NULL;
+    num_files = 0;
+}
+
+static void __attribute__((constructor)) start(void)
+{
+    char *s;
+
+    busy = 1;
+    if (real_malloc == NULL)
+	resolve();
+    if ((s = getenv("MMRECORD_PREFIX")) != NULL && *s != '\0')
+	prefix = s;
+    pthread_key_create(&buf_key, put_buf);
+    pthread_atfork(NULL, NULL, after_fork);
+    busy = 0;
+    recording = 1;
+}
+
+/*
+ * stop - Process exit: write out every log. Threads that are still
+ *     running lose what they log from here on.
+ */
+static void __attribute__((destructor)) stop(void)
+{
+    rbuf_t *b;
+
+    recording = 0;
+    busy = 1;
+    for (b = all_bufs; b != NULL; b = b->next)
+	if (b->in_use)
+	    flush_buf(b);
+    busy = 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * mmrecord.h - The log that libmmrecord.so writes
+ *
+ * Each thread of a recorded process writes its own log file,
+ * <prefix>.<pid>.<n>, as an array of rec_t in the byte order of the
+ * machine. A record carries a number from a counter that all threads
+ * share, so recmerge can put the logs of all threads back in the order
+ * the calls were made in.
+ *
+ * The pointers are stored as the process saw them. Giving blocks the
+ * dense ids of a trace, and matching frees to allocations, is left to
+ * recmerge, so the recorder needs no table that threads would share.
+ */
+#ifndef __MMRECORD_H_
+#define __MMRECORD_H_
+
+#include <stdint.h>
+
+/* Record types */
+#define REC_MALLOC  0    /* also calloc and the aligned allocators */
+#define REC_FREE    1
+#define REC_REALLOC 2
+
+typedef struct {
+    uint64_t seq;     /* order of the call among all threads */
+    uint64_t ptr;     /* block returned, or block freed */
+    uint64_t old;     /* realloc: the block passed in */
+    uint64_t size;    /* bytes asked for, 0 for a free */
+    uint32_t type;    /* REC_* */
+    uint32_t tid;     /* thread that made the call */
+} rec_t;
+
+#endif /* __MMRECORD_H_ */
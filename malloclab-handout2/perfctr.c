@@ -0,0 +1,133 @@
+/*
+ * perfctr.c - Hardware performance counters (see perfctr.h)
+ *
+ * Each event is opened on its own rather than as a group, so that a
+ * PMU with fewer counters than events multiplexes them instead of
+ * failing the group, and an event the CPU lacks costs only that event.
+ * A multiplexed count is scaled by the time the event was enabled over
+ * the time it was counting.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+/* A cache event: the cache, read accesses, misses */
+#define CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} events[PC_NUM] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int fds[PC_NUM] = {-1, -1, -1, -1, -1, -1};
+static int num_open;          /* number of events opened */
+static char error[128];       /* why no event could be opened */
+
+/*
+ * perfctr_init - Open the counters, disabled. Returns the number of
+ *     events that can be counted; 0 means wall time only, and
+ *     perfctr_error says why.
+ */
+int perfctr_init(void)
+{
+    struct perf_event_attr attr;
+    int i, err = 0;
+
+    if (num_open > 0)
+	return num_open;
+    for (i = 0; i < PC_NUM; i++) {
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    num_open++;
+	else if (err == 0)
+	    err = errno;
+    }
+    if (num_open == 0)
+	snprintf(error, sizeof(error), "perf_event_open: %s%s", strerror(err),
+		 err == ENOENT || err == ENODEV ? " (no PMU available)" : "");
+    return num_open;
+}
+
+/*
+ * perfctr_reopen - Close the counters and open them again for this
+ *     process. A forked child must call it: the counters it inherits
+ *     still count the parent. Returns what perfctr_init returns.
+ */
+int perfctr_reopen(void)
+{
+    int i;
+
+    for (i = 0; i < PC_NUM; i++)
+	if (fds[i] >= 0) {
+	    close(fds[i]);
+	    fds[i] = -1;
+	}
+    num_open = 0;
+    return perfctr_init();
+}
+
+const char *perfctr_error(void)
+{
+    return error;
+}
+
+/*
+ * perfctr_start - Zero the counters and start counting
+ */
+void perfctr_start(void)
+{
+    int i;
+
+    for (i = 0; i < PC_NUM; i++)
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/*
+ * perfctr_stop - Stop counting and return the counts since
+ *     perfctr_start in pc
+ */
+void perfctr_stop(pcounts_t *pc)
+{
+    unsigned long long buf[3]; /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PC_NUM; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PC_NUM; i++) {
+	pc->val[i] = 0;
+	pc->valid[i] = 0;
+	if (fds[i] < 0 || read(fds[i], buf, sizeof(buf)) != sizeof(buf) ||
+	    buf[2] == 0)
+	    continue;
+	pc->val[i] = (double)buf[0] * buf[1] / buf[2];
+	pc->valid[i] = 1;
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ * perfctr.h - Hardware performance counters through perf_event_open
+ *
+ * The counters count user space events of this process only, which
+ * perf_event_paranoid allows up to level 2. Where the kernel has no
+ * PMU for us (most containers and VMs) perfctr_init finds no counters
+ * and callers fall back to wall time.
+ */
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+/* The events counted, indexes into pcounts_t */
+#define PC_CYCLES       0
+#define PC_INSTRUCTIONS 1
+#define PC_L1D_MISSES   2
+#define PC_LLC_MISSES   3
+#define PC_DTLB_MISSES  4
+#define PC_BRANCH_MISSES 5
+#define PC_NUM          6
+
+typedef struct {
+    double val[PC_NUM];   /* events counted, scaled up if multiplexed */
+    int valid[PC_NUM];    /* was the event counted at all? */
+} pcounts_t;
+
+int perfctr_init(void);
+int perfctr_reopen(void);
+const char *perfctr_error(void);
+void perfctr_start(void);
+void perfctr_stop(pcounts_t *pc);
+
+#endif /* __PERFCTR_H_ */
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# plotfrag.sh - Plot the heap timeline that "mdriver -F" writes
+#
+# Usage: plotfrag.sh <timeline.csv> [<outdir>]
+#
+# Makes one PNG per policy and trace in <outdir> (default "frag"): the
+# live payload, heap size, free bytes and largest free block by request
+# on the left axis, and external fragmentation on the right. Needs
+# gnuplot; without it the gnuplot scripts are left in <outdir> to run
+# elsewhere.
+#
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+    echo "Usage: $0 <timeline.csv> [<outdir>]" >&2
+    exit 1
+fi
+csv=$1
+out=${2:-frag}
+mkdir -p "$out" || exit 1
+
+# Split the rows by policy and trace: <out>/<policy>-<trace>.dat
+awk -F, -v out="$out" '
+    NR == 1 { next }
+    {
+	f = out "/" $1 "-" $2 ".dat"
+	if (!(f in seen)) {
+	    seen[f] = 1
+	    printf "" > f
+	}
+	print $3, $4, $5, $6, $8, $9 > f
+    }' "$csv" || exit 1
+
+for dat in "$out"/*.dat; do
+    [ -f "$dat" ] || continue
+    name=$(basename "$dat" .dat)
+    policy=${name%-*}
+    trace=${name##*-}
+    cat > "$out/$name.gp" <<EOF
+set terminal png size 1000,600
+set output "$out/$name.png"
+set title "$policy policy, trace $trace"
+set xlabel "request"
+set ylabel "bytes"
+set y2label "external fragmentation"
+set y2range [0:1]
+set ytics nomirror
+set y2tics
+set key top left
+plot "$dat" using 1:3 with lines title "heap", \\
+     "$dat" using 1:2 with lines title "live payload", \\
+     "$dat" using 1:4 with lines title "free", \\
+     "$dat" using 1:5 with lines title "largest free", \\
+     "$dat" using 1:6 axes x1y2 with lines title "ext. fragmentation"
+EOF
+done
+
+if ! command -v gnuplot > /dev/null 2>&1; then
+    echo "gnuplot not found, the scripts are in $out/*.gp" >&2
+    exit 0
+fi
+for gp in "$out"/*.gp; do
+    gnuplot "$gp" || exit 1
+done
+echo "Plots are in $out/*.png"
@@ -0,0 +1,437 @@
+/*
+ * recmerge.c - Turn the logs of libmmrecord.so into a trace
+ *
+ * usage: recmerge -o <out> <log>...
+ *
+ * Merges the per-thread logs of one recorded process (see mmrecord.h)
+ * in call order and writes them out as a trace mdriver can run, in
+ * .rep format, or in the binary format of tracebin.h when the output
+ * name ends in .bin.
+ *
+ * Blocks are given ids in the order they were allocated. A realloc
+ * keeps the id of the block it was passed. Blocks that are still live
+ * when the logs end are freed at the end, so the trace is balanced.
+ * What a trace cannot hold is adapted: a free of a block allocated
+ * before recording started is dropped, an allocation of 0 bytes asks
+ * for 1, and sizes above INT_MAX are cut down to it. The header's
+ * suggested heap size is the peak of live bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "mmrecord.h"
+#include "tracebin.h"
+
+#define REP_FIELD  20           /* width of a .rep header field */
+#define READ_RECS  1024         /* records read from a log at a time */
+#define CLAMP_INT(x) ((x) > INT_MAX ? INT_MAX : (int)(x))
+
+/* A log being merged */
+typedef struct {
+    FILE *fp;
+    char *name;
+    rec_t recs[READ_RECS];
+    int n, next;                /* records read and records used */
+} log_t;
+
+/* A live block: the pointer the process saw and its trace id */
+typedef struct {
+    uint64_t ptr;               /* 0 for an empty slot */
+    unsigned id;
+    int stale;                  /* frees of ptr to come that were done early */
+} slot_t;
+
+/* Globals */
+static log_t *logs;
+static log_t **heap;            /* logs by the seq of their next record */
+static int num_heap;
+
+static slot_t *table;           /* open addressing, linear probing */
+static unsigned long table_size, table_used;
+
+static unsigned *sizes;         /* current size of each id */
+static long num_ids, max_ids;
+
+static FILE *out;
+static int binary;
+static long num_ops;
+static double live_bytes, max_live;
+static long dropped, clamped, early, lost;
+
+static int next_rec(log_t *log);
+static void sift_down(int i);
+static void merge(void);
+static slot_t *find(uint64_t ptr);
+static slot_t *insert(uint64_t ptr, unsigned id);
+static void delete(uint64_t ptr);
+static unsigned new_id(void);
+static void emit(int type, unsigned id, uint64_t size);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    char *outname = NULL;
+    char header[4 * (REP_FIELD + 1) + 1];
+    unsigned long i;
+    int c, len, n;
+
+    while ((c = getopt(argc, argv, "o:h")) != EOF) {
+	switch (c) {
+	case 'o':
+	    outname = optarg;
+	    break;
+	case 'h':
+	default:
+	    usage();
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (optind == argc || outname == NULL) {
+	usage();
+	exit(1);
+    }
+
+    /* Open the logs and heap them by their first record */
+    n = argc - optind;
+    logs = calloc(n, sizeof(log_t));
+    heap = calloc(n, sizeof(log_t *));
+    if (logs == NULL || heap == NULL) {
+	fprintf(stderr, "recmerge: out of memory\n");
+	exit(1);
+    }
+    for (c = 0; c < n; c++) {
+	logs[c].name = argv[optind + c];
+	if ((logs[c].fp = fopen(logs[c].name, "r")) == NULL) {
+	    fprintf(stderr, "recmerge: could not open %s\n", logs[c].name);
+	    exit(1);
+	}
+	if (next_rec(&logs[c]))
+	    heap[num_heap++] = &logs[c];
+    }
+    for (c = num_heap / 2 - 1; c >= 0; c--)
+	sift_down(c);
+
+    len = strlen(outname);
+    binary = len > 4 && !strcmp(outname + len - 4, ".bin");
+    if ((out = fopen(outname, "w")) == NULL) {
+	fprintf(stderr, "recmerge: could not create %s\n", outname);
+	exit(1);
+    }
+
+    /* The header is only known at the end, so leave room for it */
+    if (binary)
+	tb_write_header(out, 0, 0, 0, 0);
+    else
+	fprintf(out, "%*s", 4 * (REP_FIELD + 1), "");
+    merge();
+    for (i = 0; i < table_size; i++)
+	if (table[i].ptr != 0)
+	    emit(TB_FREE, table[i].id, 0);
+    if (num_ids == 0) {
+	fprintf(stderr, "recmerge: the logs hold no allocations\n");
+	fclose(out);
+	unlink(outname);
+	exit(1);
+    }
+
+    rewind(out);
+    if (binary)
+	tb_write_header(out, CLAMP_INT(max_live), num_ids, num_ops, 1);
+    else {
+	sprintf(header, "%-*d\n%-*ld\n%-*ld\n%-*d\n", REP_FIELD,
+		CLAMP_INT(max_live), REP_FIELD, num_ids, REP_FIELD,
+		num_ops, REP_FIELD, 1);
+	fputs(header, out);
+    }
+    if (fclose(out) != 0) {
+	fprintf(stderr, "recmerge: could not write %s\n", outname);
+	exit(1);
+    }
+    printf("%s: %ld ids, %ld requests, peak %.1f MB live\n", outname,
+	   num_ids, num_ops, max_live / (1 << 20));
+    if (dropped > 0)
+	printf("%ld frees of blocks allocated before recording dropped\n",
+	       dropped);
+    if (early > 0)
+	printf("%ld frees moved before a realloc that raced with them\n",
+	       early);
+    if (lost > 0)
+	printf("%ld blocks freed where the free was not logged\n", lost);
+    if (clamped > 0)
+	printf("%ld sizes over %d cut down\n", clamped, INT_MAX);
+    exit(0);
+}
+
+/*
+ * merge - Replay the records of all logs in call order
+ */
+static void merge(void)
+{
+    log_t *log;
+    slot_t *slot;
+    rec_t r;
+    unsigned id;
+    int stale;
+
+    while (num_heap > 0) {
+	log = heap[0];
+	r = log->recs[log->next++];
+	if (next_rec(log) == 0)
+	    heap[0] = heap[--num_heap];
+	sift_down(0);
+
+	/* Say what the call did in terms of malloc and free */
+	if (r.type == REC_REALLOC && r.old == 0)
+	    r.type = REC_MALLOC;
+	else if (r.type == REC_REALLOC && r.ptr == 0) {
+	    r.type = REC_FREE;
+	    r.ptr = r.old;
+	}
+
+	switch (r.type) {
+	case REC_MALLOC:
+	    /* A free we never saw, it cannot be live any more */
+	    if ((slot = find(r.ptr)) != NULL) {
+		emit(TB_FREE, slot->id, 0);
+		delete(r.ptr);
+		lost++;
+	    }
+	    id = new_id();
+	    insert(r.ptr, id);
+	    emit(TB_ALLOC, id, r.size);
+	    break;
+
+	case REC_REALLOC:
+	    /*
+	     * realloc took its number before it ran, so a free of the
+	     * block it moved to, by a thread that got in first, comes
+	     * after it in the log. Free that block now and drop its
+	     * free when it comes.
+	     */
+	    stale = 0;
+	    if (r.ptr != r.old && (slot = find(r.ptr)) != NULL) {
+		emit(TB_FREE, slot->id, 0);
+		stale = slot->stale + 1;
+		delete(r.ptr);
+		early++;
+	    }
+	    if ((slot = find(r.old)) == NULL) {
+		/* Allocated before recording started */
+		id = new_id();
+		insert(r.ptr, id)->stale = stale;
+		emit(TB_ALLOC, id, r.size);
+		break;
+	    }
+	    id = slot->id;
+	    delete(r.old);
+	    insert(r.ptr, id)->stale = stale;
+	    emit(TB_REALLOC, id, r.size);
+	    break;
+
+	case REC_FREE:
+	    if ((slot = find(r.ptr)) == NULL)
+		dropped++;
+	    else if (slot->stale > 0)
+		slot->stale--;
+	    else {
+		emit(TB_FREE, slot->id, 0);
+		delete(r.ptr);
+	    }
+	    break;
+
+	default:
+	    fprintf(stderr, "recmerge: %s: bad record type %u\n", log->name,
+		    r.type);
+	    exit(1);
+	}
+    }
+}
+
+/*
+ * next_rec - Make sure log has a record to look at, reading more if
+ *     it has used them all. Returns 0 at the end of the log.
+ */
+static int next_rec(log_t *log)
+{
+    size_t n;
+
+    if (log->next < log->n)
+	return 1;
+    n = fread(log->recs, 1, sizeof(log->recs), log->fp);
+    if (n % sizeof(rec_t) != 0)
+	fprintf(stderr, "recmerge: %s: ignoring a partial record at the end\n",
+		log->name);
+    log->n = n / sizeof(rec_t);
+    log->next = 0;
+    if (log->n == 0) {
+	fclose(log->fp);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * sift_down - Restore the heap below position i
+ */
+static void sift_down(int i)
+{
+    log_t *log = heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < num_heap) {
+	if (child + 1 < num_heap && heap[child + 1]->recs[heap[child + 1]->next].seq <
+	    heap[child]->recs[heap[child]->next].seq)
+	    child++;
+	if (log->recs[log->next].seq <= heap[child]->recs[heap[child]->next].seq)
+	    break;
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = log;
+}
+
+/*
+ * hash - Mix the pointer bits, the low ones are mostly alignment
+ */
+static unsigned long hash(uint64_t ptr)
+{
+    ptr ^= ptr >> 33;
+    ptr *= 0xff51afd7ed558ccdULL;
+    ptr ^= ptr >> 33;
+    return (unsigned long)ptr & (table_size - 1);
+}
+
+/*
+ * find - The slot of the live block at ptr, or NULL
+ */
+static slot_t *find(uint64_t ptr)
+{
+    unsigned long i;
+
+    if (table_size == 0)
+	return NULL;
+    for (i = hash(ptr); table[i].ptr != 0; i = (i + 1) & (table_size - 1))
+	if (table[i].ptr == ptr)
+	    return &table[i];
+    return NULL;
+}
+
+/*
+ * insert - Add a live block, growing the table to keep it at most
+ *     half full, and return its slot
+ */
+static slot_t *insert(uint64_t ptr, unsigned id)
+{
+    slot_t *old = table;
+    unsigned long old_size = table_size, i;
+
+    if (2 * (table_used + 1) > table_size) {
+	table_size = table_size ? 2 * table_size : 1024;
+	if ((table = calloc(table_size, sizeof(slot_t))) == NULL) {
+	    fprintf(stderr, "recmerge: out of memory\n");
+	    exit(1);
+	}
+	table_used = 0;
+	for (i = 0; i < old_size; i++)
+	    if (old[i].ptr != 0)
+		insert(old[i].ptr, old[i].id)->stale = old[i].stale;
+	free(old);
+    }
+    for (i = hash(ptr); table[i].ptr != 0; i = (i + 1) & (table_size - 1))
+	;
+    table[i].ptr = ptr;
+    table[i].id = id;
+    table[i].stale = 0;
+    table_used++;
+    return &table[i];
+}
+
+/*
+ * delete - Remove the block at ptr, moving back the blocks after it
+ *     that could not go where they hashed to, so that no tombstones
+ *     are needed
+ */
+static void delete(uint64_t ptr)
+{
+    unsigned long i, j, home;
+
+    for (i = hash(ptr); table[i].ptr != ptr; i = (i + 1) & (table_size - 1))
+	;
+    table[i].ptr = 0;
+    table_used--;
+    for (j = (i + 1) & (table_size - 1); table[j].ptr != 0;
+	 j = (j + 1) & (table_size - 1)) {
+	home = hash(table[j].ptr);
+	/* Leave it if its home is cyclically in (i, j] */
+	if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+	    continue;
+	table[i] = table[j];
+	table[j].ptr = 0;
+	i = j;
+    }
+}
+
+/*
+ * new_id - The next unused trace id, with no size yet
+ */
+static unsigned new_id(void)
+{
+    if (num_ids == max_ids) {
+	max_ids = max_ids ? 2 * max_ids : 1024;
+	if ((sizes = realloc(sizes, max_ids * sizeof(unsigned))) == NULL) {
+	    fprintf(stderr, "recmerge: out of memory\n");
+	    exit(1);
+	}
+    }
+    sizes[num_ids] = 0;
+    return num_ids++;
+}
+
+/*
+ * emit - Write one request and keep track of the live bytes
+ */
+static void emit(int type, unsigned id, uint64_t size)
+{
+    if (size > INT_MAX) {
+	size = INT_MAX;
+	clamped++;
+    }
+    if (type != TB_FREE && size == 0)
+	size = 1;
+
+    switch (type) {
+    case TB_ALLOC:
+	live_bytes += size;
+	sizes[id] = size;
+	break;
+    case TB_REALLOC:
+	live_bytes += (double)size - sizes[id];
+	sizes[id] = size;
+	break;
+    case TB_FREE:
+	live_bytes -= sizes[id];
+	break;
+    }
+    if (live_bytes > max_live)
+	max_live = live_bytes;
+    num_ops++;
+
+    if (binary)
+	tb_write_op(out, type, id, size);
+    else if (type == TB_FREE)
+	fprintf(out, "f %u\n", id);
+    else
+	fprintf(out, "%c %u %u\n", type == TB_ALLOC ? 'a' : 'r', id,
+		(unsigned)size);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: recmerge -o <out.rep|out.bin> <log>...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-o <file>  Trace to write, binary if it ends in .bin.\n");
+}
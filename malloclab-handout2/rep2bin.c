@@ -0,0 +1,113 @@
+/*
+ * rep2bin.c - Convert a .rep trace to the binary format of tracebin.h
+ *
+ * usage: rep2bin <in.rep> [<out.bin>]
+ *
+ * Without an output name it writes in.bin next to the input. The
+ * trace is checked the way mdriver's read_trace checks it, so mdriver
+ * can trust the header of a converted trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracebin.h"
+
+#define MAXLINE 1024
+
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    char out_name[MAXLINE];
+    char type[MAXLINE];
+    int sugg_heapsize, num_ids, num_ops, weight;
+    unsigned index, size, max_index = 0;
+    int n, t;
+    long bytes;
+
+    if (argc < 2 || argc > 3 || !strcmp(argv[1], "-h")) {
+	usage();
+	exit(argc == 2 ? 0 : 1);
+    }
+    if (argc == 3)
+	strcpy(out_name, argv[2]);
+    else {
+	char *dot;
+
+	if (strlen(argv[1]) + 5 > MAXLINE) {
+	    fprintf(stderr, "rep2bin: name too long\n");
+	    exit(1);
+	}
+	strcpy(out_name, argv[1]);
+	if ((dot = strrchr(out_name, '.')) != NULL && !strchr(dot, '/'))
+	    *dot = '\0';
+	strcat(out_name, ".bin");
+    }
+
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	fprintf(stderr, "rep2bin: could not open %s\n", argv[1]);
+	exit(1);
+    }
+    if (fscanf(in, "%d %d %d %d", &sugg_heapsize, &num_ids, &num_ops,
+	       &weight) != 4 || num_ids <= 0 || num_ops < 0 ||
+	num_ids > (1 << 30)) {
+	fprintf(stderr, "rep2bin: bad header in %s\n", argv[1]);
+	exit(1);
+    }
+    if ((out = fopen(out_name, "w")) == NULL) {
+	fprintf(stderr, "rep2bin: could not create %s\n", out_name);
+	exit(1);
+    }
+    tb_write_header(out, sugg_heapsize, num_ids, num_ops, weight);
+
+    for (n = 0; fscanf(in, "%s", type) == 1; n++) {
+	switch (type[0]) {
+	case 'a':
+	    t = TB_ALLOC;
+	    break;
+	case 'r':
+	    t = TB_REALLOC;
+	    break;
+	case 'f':
+	    t = TB_FREE;
+	    break;
+	default:
+	    fprintf(stderr, "rep2bin: bogus type character (%c) in %s\n",
+		    type[0], argv[1]);
+	    exit(1);
+	}
+	size = 0;
+	if ((t == TB_FREE ? fscanf(in, "%u", &index) != 1 :
+	     fscanf(in, "%u %u", &index, &size) != 2) ||
+	    index >= (unsigned)num_ids) {
+	    fprintf(stderr, "rep2bin: bad request %d in %s\n", n, argv[1]);
+	    exit(1);
+	}
+	if (t != TB_FREE && index > max_index)
+	    max_index = index;
+	tb_write_op(out, t, index, size);
+    }
+    fclose(in);
+    bytes = ftell(out);
+    if (fclose(out) != 0) {
+	fprintf(stderr, "rep2bin: could not write %s\n", out_name);
+	exit(1);
+    }
+    if (n != num_ops || max_index != (unsigned)num_ids - 1) {
+	fprintf(stderr, "rep2bin: %s has %d requests and %u ids, "
+		"the header says %d and %d\n", argv[1], n, max_index + 1,
+		num_ops, num_ids);
+	remove(out_name);
+	exit(1);
+    }
+    printf("%s: %d requests in %ld bytes\n", out_name, n, bytes);
+    exit(0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: rep2bin <in.rep> [<out.bin>]\n");
+    fprintf(stderr, "Converts a trace to the binary format mdriver maps.\n");
+}
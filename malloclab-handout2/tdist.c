@@ -0,0 +1,22 @@
+/*
+ * tdist.c - Quantiles of Student's t distribution (see tdist.h)
+ */
+#include "tdist.h"
+
+/*
+ * t_975 - The 97.5th percentile of Student's t with df degrees of
+ *     freedom, for a two sided 95% interval
+ */
+double t_975(int df)
+{
+    static const double t[] = {0, 12.706, 4.303, 3.182, 2.776, 2.571,
+			       2.447, 2.365, 2.306, 2.262, 2.228, 2.201,
+			       2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+			       2.101, 2.093, 2.086, 2.080, 2.074, 2.069,
+			       2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+			       2.042};
+
+    if (df < (int)(sizeof(t) / sizeof(double)))
+	return t[df];
+    return df < 60 ? 2.021 : df < 120 ? 2.000 : 1.960;
+}
@@ -0,0 +1,10 @@
+/*
+ * tdist.h - Quantiles of Student's t distribution, for the confidence
+ * intervals that fsecs_stats and mmbench put around a mean time
+ */
+#ifndef __TDIST_H_
+#define __TDIST_H_
+
+double t_975(int df);
+
+#endif /* __TDIST_H_ */
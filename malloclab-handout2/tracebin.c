@@ -0,0 +1,96 @@
+/*
+ * tracebin.c - map and write binary traces (see tracebin.h)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracebin.h"
+
+/*
+ * tb_map - Map the binary trace in path read only. Returns 1 when it
+ *     is mapped, 0 when path is not a binary trace (a .rep file, say)
+ *     and -1 with errno set when it cannot be opened or mapped.
+ */
+int tb_map(const char *path, tb_map_t *map)
+{
+    struct stat st;
+    tb_header_t hdr;
+    void *p;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return -1;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	hdr.magic != TB_MAGIC || hdr.version != TB_VERSION) {
+	close(fd);
+	return 0;
+    }
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+	return -1;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    map->hdr = p;
+    map->ops = (const unsigned char *)p + sizeof(tb_header_t);
+    map->end = (const unsigned char *)p + st.st_size;
+    map->len = st.st_size;
+    return 1;
+}
+
+/*
+ * tb_unmap - Unmap a trace mapped by tb_map
+ */
+void tb_unmap(tb_map_t *map)
+{
+    munmap(map->hdr, map->len);
+    memset(map, 0, sizeof(*map));
+}
+
+/*
+ * put_varint - Write v 7 bits at a time, low bits first
+ */
+static void put_varint(FILE *fp, unsigned v)
+{
+    while (v >= 0x80) {
+	putc((v & 0x7f) | 0x80, fp);
+	v >>= 7;
+    }
+    putc(v, fp);
+}
+
+/*
+ * tb_write_header - Start a binary trace in fp
+ */
+void tb_write_header(FILE *fp, int sugg_heapsize, int num_ids, int num_ops,
+		     int weight)
+{
+    tb_header_t hdr;
+
+    hdr.magic = TB_MAGIC;
+    hdr.version = TB_VERSION;
+    hdr.sugg_heapsize = sugg_heapsize;
+    hdr.num_ids = num_ids;
+    hdr.num_ops = num_ops;
+    hdr.weight = weight;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+}
+
+/*
+ * tb_write_op - Append one request to a binary trace. The size is
+ *     left out for frees.
+ */
+void tb_write_op(FILE *fp, int type, unsigned index, unsigned size)
+{
+    put_varint(fp, index << 2 | type);
+    if (type != TB_FREE)
+	put_varint(fp, size);
+}
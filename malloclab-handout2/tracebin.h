@@ -0,0 +1,97 @@
+/*
+ * tracebin.h - the packed binary trace format
+ *
+ * A binary trace holds the same requests as a .rep file, but is read
+ * by mapping it instead of parsing it. The file is a tb_header_t
+ * followed by one record per request:
+ *
+ *   varint((index << 2) | type)      every request
+ *   varint(size)                     alloc and realloc only
+ *
+ * where a varint is an unsigned number stored 7 bits per byte, low
+ * bits first, with the top bit set on every byte but the last. Most
+ * requests take 3 or 4 bytes instead of the 12 of a traceop_t.
+ *
+ * rep2bin converts .rep files to this format, and mdriver reads
+ * either kind, telling them apart by the magic number.
+ */
+#ifndef __TRACEBIN_H_
+#define __TRACEBIN_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define TB_MAGIC   0x42546d6d   /* "mmTB" */
+#define TB_VERSION 1
+
+/* Request types, in the order of mdriver's traceop_t */
+#define TB_ALLOC   0
+#define TB_FREE    1
+#define TB_REALLOC 2
+
+typedef struct {
+    unsigned magic;      /* TB_MAGIC */
+    unsigned version;    /* TB_VERSION */
+    int sugg_heapsize;   /* the four numbers at the top of a .rep file */
+    int num_ids;
+    int num_ops;
+    int weight;
+} tb_header_t;
+
+/* A mapped binary trace */
+typedef struct {
+    tb_header_t *hdr;            /* start of the mapping */
+    const unsigned char *ops;    /* first request */
+    const unsigned char *end;    /* one past the last request */
+    size_t len;                  /* bytes mapped */
+} tb_map_t;
+
+int tb_map(const char *path, tb_map_t *map);
+void tb_unmap(tb_map_t *map);
+void tb_write_header(FILE *fp, int sugg_heapsize, int num_ids, int num_ops,
+		     int weight);
+void tb_write_op(FILE *fp, int type, unsigned index, unsigned size);
+
+/*
+ * tb_get_varint - Decode the varint at p into *v and return the byte
+ *     after it, or NULL if it runs into end or does not fit in 32 bits
+ */
+static inline const unsigned char *tb_get_varint(const unsigned char *p,
+						 const unsigned char *end,
+						 unsigned *v)
+{
+    unsigned shift;
+
+    for (*v = 0, shift = 0; p < end; shift += 7) {
+	if (shift == 28 && (*p & 0xf0))
+	    return NULL;
+	*v |= (unsigned)(*p & 0x7f) << shift;
+	if (!(*p++ & 0x80))
+	    return p;
+    }
+    return NULL;
+}
+
+/*
+ * tb_get_op - Decode the request at p, which ends by end at the latest,
+ *     and return the next one, or NULL if the request is cut short. It
+ *     is inline because the replay loops call it once per request.
+ */
+static inline const unsigned char *tb_get_op(const unsigned char *p,
+					     const unsigned char *end,
+					     int *type, unsigned *index,
+					     unsigned *size)
+{
+    unsigned v;
+
+    if ((p = tb_get_varint(p, end, &v)) == NULL)
+	return NULL;
+    *type = v & 3;
+    *index = v >> 2;
+    *size = 0;
+    if (*type != TB_FREE)
+	p = tb_get_varint(p, end, size);
+    return p;
+}
+
+#endif /* __TRACEBIN_H_ */
@@ -0,0 +1,169 @@
+/*
+ * tsc.c - Timing with the x86 time stamp counter (see tsc.h)
+ *
+ * The rate of the counter is taken from the kernel where it says, in
+ * this order:
+ *
+ *   tsc_freq_khz  the sysfs file some kernels have
+ *   perf          the scale perf_event_open publishes for converting
+ *                 the TSC to its clock, when it allows user space to
+ *   calibration   ticks counted against CLOCK_MONOTONIC_RAW, which
+ *                 NTP does not slew, over a few short busy waits
+ *
+ * Unlike mhz_full in clock.c, nothing here sleeps, so the CPU is not
+ * allowed to change speed or sleep state while we calibrate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "tsc.h"
+
+#define CAL_ROUNDS 5         /* calibration waits, the median counts */
+#define CAL_NSECS  20000000  /* length of each, 20 ms */
+
+static double hz;            /* ticks per second, 0 if no usable TSC */
+static char error[128];      /* why there is none */
+
+static int has_invariant_tsc(void);
+static double hz_sysfs(void);
+static double hz_perf(void);
+static double hz_calibrate(void);
+static long long raw_ns(void);
+
+/*
+ * tsc_init - Find the rate of the counter. Returns 1 if the TSC can be
+ *     used, 0 if not, and tsc_error says why.
+ */
+int tsc_init(void)
+{
+    if (hz > 0)
+	return 1;
+    if (!has_invariant_tsc()) {
+	snprintf(error, sizeof(error), "no invariant TSC with rdtscp");
+	return 0;
+    }
+    if ((hz = hz_sysfs()) == 0 && (hz = hz_perf()) == 0)
+	hz = hz_calibrate();
+    if (hz <= 0) {
+	snprintf(error, sizeof(error), "could not find the TSC rate");
+	hz = 0;
+	return 0;
+    }
+    return 1;
+}
+
+double tsc_hz(void)
+{
+    return hz;
+}
+
+const char *tsc_error(void)
+{
+    return error;
+}
+
+/*
+ * has_invariant_tsc - Does cpuid report rdtscp and an invariant TSC?
+ */
+static int has_invariant_tsc(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned a, b, c, d;
+
+    if (__get_cpuid(0x80000000, &a, &b, &c, &d) == 0 || a < 0x80000007)
+	return 0;
+    __get_cpuid(0x80000001, &a, &b, &c, &d);
+    if (!(d & (1 << 27)))            /* rdtscp */
+	return 0;
+    __get_cpuid(0x80000007, &a, &b, &c, &d);
+    return (d & (1 << 8)) != 0;      /* invariant TSC */
+#else
+    return 0;
+#endif
+}
+
+static double hz_sysfs(void)
+{
+    FILE *fp = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+    double khz = 0;
+
+    if (fp == NULL)
+	return 0;
+    if (fscanf(fp, "%lf", &khz) != 1)
+	khz = 0;
+    fclose(fp);
+    return khz * 1e3;
+}
+
+/*
+ * hz_perf - The rate from the mmap page of a perf event. The kernel
+ *     converts the TSC to nanoseconds as (ticks * time_mult) >>
+ *     time_shift, so there are 2^time_shift / time_mult ticks a ns.
+ */
+static double hz_perf(void)
+{
+    struct perf_event_attr attr;
+    struct perf_event_mmap_page *pg;
+    double rate = 0;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_DUMMY;
+    attr.exclude_kernel = 1;
+    if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) < 0)
+	return 0;
+    pg = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (pg != MAP_FAILED) {
+	if (pg->cap_user_time && pg->time_mult != 0)
+	    rate = 1e9 * (double)(1ULL << pg->time_shift) / pg->time_mult;
+	munmap(pg, sysconf(_SC_PAGESIZE));
+    }
+    close(fd);
+    return rate;
+}
+
+/*
+ * hz_calibrate - Count ticks while the raw monotonic clock advances
+ *     CAL_NSECS, CAL_ROUNDS times, and take the median rate
+ */
+static double hz_calibrate(void)
+{
+    double rates[CAL_ROUNDS], t;
+    unsigned long long c0;
+    long long t0, t1;
+    int i, j;
+
+    for (i = 0; i < CAL_ROUNDS; i++) {
+	t0 = raw_ns();
+	c0 = tsc_read();
+	while ((t1 = raw_ns()) - t0 < CAL_NSECS)
+	    ;
+	rates[i] = (tsc_read() - c0) * 1e9 / (t1 - t0);
+    }
+    for (i = 1; i < CAL_ROUNDS; i++)
+	for (j = i; j > 0 && rates[j - 1] > rates[j]; j--) {
+	    t = rates[j];
+	    rates[j] = rates[j - 1];
+	    rates[j - 1] = t;
+	}
+    return rates[CAL_ROUNDS / 2];
+}
+
+static long long raw_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
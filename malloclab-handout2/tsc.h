@@ -0,0 +1,36 @@
+/*
+ * tsc.h - Timing with the x86 time stamp counter
+ *
+ * On CPUs with an invariant TSC the counter ticks at a constant rate
+ * whatever the clock speed and sleep states, and is the cheapest clock
+ * there is: tsc_read costs a few dozen cycles and resolves well below
+ * a nanosecond. tsc_init checks the CPU has one and finds its rate;
+ * where it cannot (other CPUs, or no invariant TSC) callers fall back
+ * to the system clock.
+ */
+#ifndef __TSC_H_
+#define __TSC_H_
+
+int tsc_init(void);
+double tsc_hz(void);
+const char *tsc_error(void);
+
+/*
+ * tsc_read - The counter. rdtscp waits for the instructions before it
+ *     to finish, the lfences keep earlier loads from drifting past it
+ *     and later instructions from starting before it.
+ */
+static inline unsigned long long tsc_read(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned lo, hi, aux;
+
+    __asm__ __volatile__("lfence\n\trdtscp\n\tlfence"
+			 : "=a" (lo), "=d" (hi), "=c" (aux) : : "memory");
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+#endif /* __TSC_H_ */